@@ -1,3 +1,4 @@
+#include <atomic>
 #include <chrono>
 #include "clock.hpp"
 
@@ -5,8 +6,17 @@ namespace Sb {
       namespace Clock {
             static int64_t driftCorrectionInNs = std::chrono::duration_cast <NanoSecs> (std::chrono::system_clock::now().time_since_epoch() -
                                                  std::chrono::steady_clock::now().time_since_epoch()).count();
+            static std::atomic<int64_t> cachedNs{std::chrono::duration_cast<NanoSecs>(SteadyClock::now().time_since_epoch()).count()};
             int64_t now() {
                   return std::chrono::duration_cast <NanoSecs> (SteadyClock::now().time_since_epoch()).count() + driftCorrectionInNs;
             }
+
+            TimePointNs cached() {
+                  return TimePointNs{NanoSecs{cachedNs.load(std::memory_order_relaxed)}};
+            }
+
+            void tick() {
+                  cachedNs.store(std::chrono::duration_cast<NanoSecs>(SteadyClock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+            }
       }
 }
@@ -13,6 +13,9 @@ namespace Sb {
       constexpr int64_t NanoSecsInSecs{ONE_SEC_IN_NS};
       namespace Clock {
             int64_t now();
+            // The steady time of the engine's last tick: cheap, and at most one epoll wake stale.
+            TimePointNs cached();
+            void tick();
             template<typename T, typename U>
             inline auto elapsed(T const& start, U const& end) -> decltype(end - start) const {
                   return end - start;
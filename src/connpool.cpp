@@ -0,0 +1,148 @@
+﻿#include <algorithm>
+#include "logger.hpp"
+#include "connpool.hpp"
+
+namespace Sb {
+      // Stands in for the client while a stream is parked; anything arriving on an idle
+      // stream means it can no longer be handed out.
+      class ConnectionPool::IdleConn final : public TcpStreamIf {
+      public:
+            IdleConn(Key const& key, NanoSecs const activeTimeout) : key(key), activeTimeout(activeTimeout) {
+            }
+
+            virtual void received(Bytes const&) override {
+                  evict();
+            }
+
+            virtual void writeComplete() override {
+            }
+
+            virtual void disconnected() override {
+                  thePool().forget(this);
+            }
+
+            virtual void peerClosedWrite() override {
+                  evict();
+            }
+
+            virtual void drain() override {
+                  evict();
+            }
+
+            std::shared_ptr<TcpStream> stream() const {
+                  return tcpStream.lock();
+            }
+
+            void evict() {
+                  auto ref = tcpStream.lock();
+                  if(ref) {
+                        ref->disconnect();
+                  }
+            }
+
+            Key const key;
+            NanoSecs const activeTimeout;
+      };
+
+      ConnectionPool& ConnectionPool::thePool() {
+            static ConnectionPool pool;
+            return pool;
+      }
+
+      ConnectionPool::Key ConnectionPool::keyOf(InetDest const& dest) {
+            return Key(dest.addr.d, dest.port, dest.path);
+      }
+
+      bool ConnectionPool::acquire(InetDest const& dest, std::shared_ptr<TcpStreamIf> const& client) {
+            auto& pool = thePool();
+            for(; ;) {
+                  std::shared_ptr<IdleConn> conn;
+                  {
+                        std::lock_guard<std::mutex> sync(pool.lock);
+                        auto const it = pool.idle.find(keyOf(dest));
+                        if(it == pool.idle.end()) {
+                              return false;
+                        }
+                        conn = std::move(it->second.back());
+                        it->second.pop_back();
+                        if(it->second.size() == 0) {
+                              pool.idle.erase(it);
+                        }
+                        --pool.numIdle;
+                  }
+                  auto const stream = conn->stream();
+                  if(stream && stream->reusable()) {
+                        stream->setInactivityTimeout(conn->activeTimeout);
+                        stream->rebind(client);
+                        return true;
+                  }
+                  conn->evict();
+            }
+      }
+
+      void ConnectionPool::release(std::shared_ptr<TcpStream> const& stream) {
+            auto& pool = thePool();
+            auto const dest = stream->peerEndPoint();
+            if(!dest.valid || !stream->reusable() || Engine::isDraining()) {
+                  stream->disconnect();
+                  return;
+            }
+            auto const conn = std::make_shared<IdleConn>(keyOf(dest), stream->getInactivityTimeout());
+            NanoSecs idleTimeout;
+            {
+                  std::lock_guard<std::mutex> sync(pool.lock);
+                  idleTimeout = pool.limits.idleTimeout;
+            }
+            stream->setInactivityTimeout(idleTimeout);
+            stream->rebind(conn);
+            std::shared_ptr<IdleConn> evicted;
+            {
+                  std::lock_guard<std::mutex> sync(pool.lock);
+                  if(pool.numIdle >= pool.limits.maxIdle) {
+                        evicted = conn;
+                  } else {
+                        auto& parked = pool.idle[conn->key];
+                        if(parked.size() >= pool.limits.maxIdlePerDestination) {
+                              evicted = std::move(parked.front());
+                              parked.pop_front();
+                              --pool.numIdle;
+                        }
+                        parked.push_back(conn);
+                        ++pool.numIdle;
+                  }
+            }
+            if(evicted) {
+                  evicted->evict();
+            }
+      }
+
+      void ConnectionPool::forget(IdleConn const* const conn) {
+            std::lock_guard<std::mutex> sync(lock);
+            auto const it = idle.find(conn->key);
+            if(it == idle.end()) {
+                  return;
+            }
+            auto const pos = std::find_if(it->second.begin(), it->second.end(), [conn](std::shared_ptr<IdleConn> const& what) {
+                  return what.get() == conn;
+            });
+            if(pos != it->second.end()) {
+                  it->second.erase(pos);
+                  --numIdle;
+                  if(it->second.size() == 0) {
+                        idle.erase(it);
+                  }
+            }
+      }
+
+      void ConnectionPool::setLimits(PoolLimits const& newLimits) {
+            auto& pool = thePool();
+            std::lock_guard<std::mutex> sync(pool.lock);
+            pool.limits = newLimits;
+      }
+
+      std::size_t ConnectionPool::idleCount() {
+            auto& pool = thePool();
+            std::lock_guard<std::mutex> sync(pool.lock);
+            return pool.numIdle;
+      }
+}
@@ -0,0 +1,40 @@
+﻿#pragma once
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include "tcpstream.hpp"
+
+namespace Sb {
+      class PoolLimits final {
+      public:
+            std::size_t maxIdlePerDestination = 8;
+            std::size_t maxIdle = 256;
+            NanoSecs idleTimeout = NanoSecs{30 * ONE_SEC_IN_NS};
+      };
+
+      // Keeps connected upstream streams that a client has finished with so that a later
+      // connection to the same destination can skip the handshake.
+      class ConnectionPool final {
+      public:
+            static bool acquire(InetDest const& dest, std::shared_ptr<TcpStreamIf> const& client);
+            static void release(std::shared_ptr<TcpStream> const& stream);
+            static void setLimits(PoolLimits const& limits);
+            static std::size_t idleCount();
+      private:
+            class IdleConn;
+            // Address and port, or the path of a Unix stream.
+            typedef std::tuple<std::array<uint16_t, ADDR_LEN_SIZE_T>, uint16_t, std::string> Key;
+
+            static ConnectionPool& thePool();
+            static Key keyOf(InetDest const& dest);
+            void forget(IdleConn const* const conn);
+      private:
+            std::mutex lock;
+            PoolLimits limits;
+            std::map<Key, std::deque<std::shared_ptr<IdleConn>>> idle;
+            std::size_t numIdle = 0;
+      };
+}
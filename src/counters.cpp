@@ -1,34 +1,149 @@
+﻿#include <cstdlib>
+#include <new>
 #include "counters.hpp"
 
 namespace Sb {
-      Counters::Counters() : start(SteadyClock::now()), lastEgress(SteadyClock::now()), lastIngress(SteadyClock::now()) {
+      ShardedCounter Counters::allIngress;
+      ShardedCounter Counters::allEgress;
+      std::mutex TrafficTotals::registryLock;
+      std::map<std::pair<std::string, std::string>, std::weak_ptr<TrafficTotals>> TrafficTotals::groups;
+      std::size_t TrafficTotals::prunedAt = 0;
+
+      uint64_t ShardedCounter::load() const {
+            uint64_t sum = 0;
+            for(auto const& cell : cells) {
+                  sum += cell.value.load(std::memory_order_relaxed);
+            }
+            return sum;
+      }
+
+      TrafficTotals::TrafficTotals(std::string const& listener, std::string const& client, std::shared_ptr<TrafficTotals> const& parent)
+                  : listener(listener), client(client), parent(parent) {
+      }
+
+      // The global operator new of C++14, and with it make_shared, ignores the cells' alignment.
+      static std::shared_ptr<TrafficTotals> makeAligned(std::string const& listener, std::string const& client,
+                                                        std::shared_ptr<TrafficTotals> const& parent) {
+            void* memory = nullptr;
+            if(::posix_memalign(&memory, alignof(TrafficTotals), sizeof(TrafficTotals)) != 0) {
+                  throw std::bad_alloc();
+            }
+            TrafficTotals* group = nullptr;
+            try {
+                  group = new(memory) TrafficTotals(listener, client, parent);
+            } catch(...) {
+                  ::free(memory);
+                  throw;
+            }
+            return std::shared_ptr<TrafficTotals>(group, [](TrafficTotals* const done) {
+                  done->~TrafficTotals();
+                  ::free(done);
+            });
+      }
+
+      std::shared_ptr<TrafficTotals> TrafficTotals::get(std::string const& listener, std::string const& client, std::shared_ptr<TrafficTotals> const& parent) {
+            std::lock_guard<std::mutex> sync(registryLock);
+            auto& entry = groups[std::make_pair(listener, client)];
+            auto group = entry.lock();
+            if(!group) {
+                  group = makeAligned(listener, client, parent);
+                  entry = group;
+                  if(groups.size() > 2 * prunedAt) {
+                        for(auto it = groups.begin(); it != groups.end();) {
+                              it = it->second.expired() ? groups.erase(it) : std::next(it);
+                        }
+                        prunedAt = groups.size();
+                  }
+            }
+            return group;
+      }
+
+      std::vector<TrafficSnapshot> TrafficTotals::registry() {
+            std::vector<std::shared_ptr<TrafficTotals>> live;
+            {
+                  std::lock_guard<std::mutex> sync(registryLock);
+                  for(auto const& entry : groups) {
+                        auto group = entry.second.lock();
+                        if(group) {
+                              live.push_back(group);
+                        }
+                  }
+            }
+            std::vector<TrafficSnapshot> snaps;
+            for(auto const& group : live) {
+                  snaps.push_back(group->snapshot());
+            }
+            return snaps;
+      }
+
+      void TrafficTotals::notifyIngress(uint64_t const count) {
+            ingress.add(count);
+            if(parent) {
+                  parent->notifyIngress(count);
+            }
+      }
+
+      void TrafficTotals::notifyEgress(uint64_t const count) {
+            egress.add(count);
+            if(parent) {
+                  parent->notifyEgress(count);
+            }
+      }
+
+      TrafficSnapshot TrafficTotals::snapshot() const {
+            TrafficSnapshot snap;
+            snap.listener = listener;
+            snap.client = client;
+            snap.ingress = ingress.load();
+            snap.egress = egress.load();
+            return snap;
+      }
+
+      Counters::Counters() : start(Clock::cached()), lastEgress(start.time_since_epoch().count()), lastIngress(start.time_since_epoch().count()) {
       }
 
       Counters::~Counters() {
-            std::lock_guard<std::mutex> sync(lock);
+      }
+
+      void Counters::setTotals(std::shared_ptr<TrafficTotals> const& group) {
+            totals = group;
       }
 
       void Counters::dumpStats() const {
-            auto elapsedNs = Clock::elapsed(start, SteadyClock::now()).count();
+            auto elapsedNs = Clock::elapsed(start, Clock::cached()).count();
             if (elapsedNs <= 0) {
                   elapsedNs = 1;
             }
-            logDebug("Elapsed: " + std::to_string(elapsedNs) + " IN " + std::to_string(ingress) + " OUT " + std::to_string(egress));
+            logDebug("Elapsed: " + std::to_string(elapsedNs) + " IN " + std::to_string(getIngress()) + " OUT " + std::to_string(getEgress()));
       };
 
       void Counters::notifyIngress(ssize_t const count) {
             if (count > 0) {
-                  std::lock_guard<std::mutex> sync(lock);
-                  lastIngress = SteadyClock::now();
-                  ingress += count;
+                  lastIngress.store(Clock::cached().time_since_epoch().count(), std::memory_order_relaxed);
+                  ingress.fetch_add(count, std::memory_order_relaxed);
+                  allIngress.add(count);
+                  if(totals) {
+                        totals->notifyIngress(count);
+                  }
             }
       }
 
       void Counters::notifyEgress(ssize_t const count) {
             if (count > 0) {
-                  std::lock_guard<std::mutex> sync(lock);
-                  lastEgress = SteadyClock::now();
-                  egress += count;
+                  lastEgress.store(Clock::cached().time_since_epoch().count(), std::memory_order_relaxed);
+                  egress.fetch_add(count, std::memory_order_relaxed);
+                  allEgress.add(count);
+                  if(totals) {
+                        totals->notifyEgress(count);
+                  }
             }
       }
+
+      uint64_t Counters::totalIngress() {
+            return allIngress.load();
+      }
+
+      uint64_t Counters::totalEgress() {
+            return allEgress.load();
+      }
 }
@@ -1,28 +1,100 @@
-#pragma once
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "utils.hpp"
 #include "clock.hpp"
 
 namespace Sb {
+      // A counter split into per-thread cells so that concurrent adds never share a cache line. Heap
+      // objects holding one must come from cache-line aligned storage, as TrafficTotals does.
+      class ShardedCounter final {
+      public:
+            void add(uint64_t const value) {
+                  cells[threadShard()].value.fetch_add(value, std::memory_order_relaxed);
+            }
+
+            uint64_t load() const;
+      private:
+            class alignas(CACHE_LINE_SIZE) Cell final {
+            public:
+                  std::atomic<uint64_t> value{0};
+            };
+
+            std::array<Cell, THREAD_SHARDS> cells;
+      };
+
+      class TrafficSnapshot final {
+      public:
+            std::string listener;
+            std::string client;
+            uint64_t ingress = 0;
+            uint64_t egress = 0;
+      };
+
+      // Byte totals for a group of streams, registered by listener and client. A client's group adds
+      // into its listener's group as well, so either level can be read without walking the streams;
+      // it stays registered while any of its streams or its listener is alive.
+      class TrafficTotals final {
+      public:
+            static std::shared_ptr<TrafficTotals> get(std::string const& listener, std::string const& client = std::string(),
+                                                      std::shared_ptr<TrafficTotals> const& parent = nullptr);
+            static std::vector<TrafficSnapshot> registry();
+            TrafficTotals(std::string const& listener, std::string const& client, std::shared_ptr<TrafficTotals> const& parent);
+            void notifyIngress(uint64_t const count);
+            void notifyEgress(uint64_t const count);
+            TrafficSnapshot snapshot() const;
+      private:
+            static std::mutex registryLock;
+            static std::map<std::pair<std::string, std::string>, std::weak_ptr<TrafficTotals>> groups;
+            static std::size_t prunedAt;
+            std::string const listener;
+            std::string const client;
+            std::shared_ptr<TrafficTotals> const parent;
+            ShardedCounter ingress;
+            ShardedCounter egress;
+      };
+
+      // Per-stream byte counts. Updates are relaxed atomics stamped with the engine's cached clock, so
+      // the I/O paths never lock or read the clock themselves.
       class Counters final {
       public:
             Counters();
             ~Counters();
             void notifyIngress(ssize_t const count);
             void notifyEgress(ssize_t const count);
+            void setTotals(std::shared_ptr<TrafficTotals> const& group);
             void dumpStats() const;
+            // Bytes moved by every stream since start.
+            static uint64_t totalIngress();
+            static uint64_t totalEgress();
             ssize_t getIngress() const {
-                  return ingress;
+                  return ingress.load(std::memory_order_relaxed);
             }
 
             ssize_t getEgress() const {
-                  return egress;
+                  return egress.load(std::memory_order_relaxed);
+            }
+
+            TimePointNs getLastIngress() const {
+                  return TimePointNs{NanoSecs{lastIngress.load(std::memory_order_relaxed)}};
+            }
+
+            TimePointNs getLastEgress() const {
+                  return TimePointNs{NanoSecs{lastEgress.load(std::memory_order_relaxed)}};
             }
       private:
-            std::mutex lock;
-            TimePointNs start;
-            TimePointNs lastEgress;
-            TimePointNs lastIngress;
-            ssize_t ingress = 0;
-            ssize_t egress = 0;
+            TimePointNs const start;
+            std::atomic<int64_t> lastEgress;
+            std::atomic<int64_t> lastIngress;
+            std::atomic<ssize_t> ingress{0};
+            std::atomic<ssize_t> egress{0};
+            std::shared_ptr<TrafficTotals> totals;
+            static ShardedCounter allIngress;
+            static ShardedCounter allEgress;
       };
 }
@@ -4,17 +4,22 @@
 #include <pthread.h>
 #include <algorithm>
 #include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <execinfo.h>
 #include "engine.hpp"
+#include "trace.hpp"
 
 namespace Sb {
       Engine* Engine::theEngine = nullptr;
 
+      thread_local Engine::Worker* Engine::currentWorker = nullptr;
+
       Engine::Worker::~Worker() {
             thread.detach();
       }
 
       Engine::Engine() : stopping(false), activeCount(0), epollTid(std::this_thread::get_id()), epollThreadHandle(::pthread_self()),
-                         epollFd(::epoll_create1(EPOLL_CLOEXEC)), timerFd(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)),
+                         epollFd(::epoll_create1(EPOLL_CLOEXEC)), timerFd(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
                          timers(std::bind(&Engine::setTimerTrigger, this, std::placeholders::_1, std::placeholders::_2)) {
             Logger::start();
             Logger::setMask(Logger::LogType::EVERYTHING);
@@ -44,19 +49,205 @@ namespace Sb {
             }
       }
 
-      void signalHandler(int) {
-            Engine::theEngine->doSignalHandler();
+      EngineLoad Engine::load() {
+            if(Engine::theEngine == nullptr) {
+                  return EngineLoad();
+            }
+            return Engine::theEngine->doLoad();
+      }
+
+      EngineLatency Engine::latency() {
+            if(Engine::theEngine == nullptr) {
+                  return EngineLatency();
+            }
+            return Engine::theEngine->doLatency();
+      }
+
+      EngineLatency Engine::doLatency() const {
+            EngineLatency latency;
+            latency.queueWait = queueWaitHistogram.snapshot();
+            for(std::size_t i = 0; i < NUM_HANDLER_KINDS; ++i) {
+                  latency.handlerRun[i] = handlerRunHistograms[i].snapshot();
+            }
+            latency.epollBatch = epollBatchHistogram.snapshot();
+            latency.timerLag = timerLagHistogram.snapshot();
+            return latency;
+      }
+
+      EngineLoad Engine::doLoad() {
+            EngineLoad load;
+            auto const now = SteadyClock::now();
+            {
+                  std::lock_guard<std::mutex> sync(eqLock);
+                  for(std::size_t i = 0; i < NUM_PRIORITIES; ++i) {
+                        auto const& queue = eventQueues[i];
+                        load.queueDepths[i] = queue.size();
+                        load.queueDepth += queue.size();
+                        if(!queue.empty()) {
+                              load.queueWait = std::max(load.queueWait, Clock::elapsed(queue.front().queuedAt, now));
+                        }
+                  }
+            }
+            load.connections = numSockets;
+            load.timers = timers.size();
+            return load;
+      }
+
+      void Engine::drain() {
+            if(Engine::theEngine != nullptr) {
+                  Engine::theEngine->doDrain();
+            }
+      }
+
+      void Engine::setDrainTimeout(NanoSecs const timeout) {
+            if(Engine::theEngine == nullptr) {
+                  throw std::runtime_error("Engine::setDrainTimeout Please call Engine::Init() first");
+            }
+            Engine::theEngine->drainTimeout = timeout;
+      }
+
+      void Engine::setWatchdog(WatchdogOptions const& options) {
+            if(Engine::theEngine == nullptr) {
+                  throw std::runtime_error("Engine::setWatchdog Please call Engine::Init() first");
+            }
+            Engine::theEngine->watchdogOptions = options;
       }
 
-      void Engine::doSignalHandler() {
-            if(!stopping && epollTid == std::this_thread::get_id()) {
+      std::vector<SlowHandler> Engine::slowHandlers() {
+            if(Engine::theEngine == nullptr) {
+                  return std::vector<SlowHandler>();
+            }
+            std::lock_guard<std::mutex> sync(Engine::theEngine->slowLock);
+            return std::vector<SlowHandler>(Engine::theEngine->slowLog.begin(), Engine::theEngine->slowLog.end());
+      }
+
+      bool Engine::isDraining() {
+            return Engine::theEngine != nullptr && Engine::theEngine->draining;
+      }
+
+      DrainProgress Engine::drainProgress() {
+            if(Engine::theEngine == nullptr) {
+                  return DrainProgress();
+            }
+            return Engine::theEngine->doDrainProgress();
+      }
+
+      void signalHandler(int sig) {
+            Engine::theEngine->doSignalHandler(sig);
+      }
+
+      void Engine::doSignalHandler(int const sig) {
+            if(sig == SIGTERM) {
+                  drainRequested = true;
+                  if(epollTid != std::this_thread::get_id()) {
+                        ::pthread_kill(epollThreadHandle, SIGTERM);
+                  }
+            } else if(sig == SIGPROF) {
+                  // The watchdog asks a stalled worker for its stack.
+                  if(currentWorker != nullptr) {
+                        currentWorker->stackDepth = ::backtrace(currentWorker->stack.data(), currentWorker->stack.size());
+                        currentWorker->stackReady = true;
+                  }
+            } else if(sig == SIGUSR2) {
+                  // Files cannot be written from a signal handler; the epoll loop starts the dump.
+                  traceDumpRequested = true;
+                  if(epollTid != std::this_thread::get_id()) {
+                        ::pthread_kill(epollThreadHandle, SIGUSR2);
+                  }
+            } else if(!stopping && epollTid == std::this_thread::get_id()) {
                   std::lock_guard<std::mutex> sync(evHashLock);
                   stopping = true;
             }
       }
 
-      void Engine::startWorkers(int minWorkersPerCpu) {
+      void Engine::doDrain() {
+            if(!drainRequested.exchange(true) && epollTid != std::this_thread::get_id()) {
+                  ::pthread_kill(epollThreadHandle, SIGTERM);
+            }
+      }
+
+      // Runs on the epoll thread. Listeners go first, then the streams with nothing left to send.
+      void Engine::startDrain() {
+            std::vector<std::pair<std::size_t, std::shared_ptr<Socket>>> sockets;
+            {
+                  std::lock_guard<std::mutex> sync(evHashLock);
+                  sockets.reserve(eventHash.size());
+                  for(auto const& entry : eventHash) {
+                        sockets.emplace_back(0, entry.second);
+                  }
+            }
+            for(auto& entry : sockets) {
+                  entry.first = entry.second->pendingBytes();
+            }
+            std::stable_sort(sockets.begin(), sockets.end(), [](std::pair<std::size_t, std::shared_ptr<Socket>> const& a,
+                                                                 std::pair<std::size_t, std::shared_ptr<Socket>> const& b) {
+                  return a.first < b.first;
+            });
+            drainDeadline = SteadyClock::now() + drainTimeout;
+            nextDrainReport = SteadyClock::now() + DRAIN_REPORT_INTERVAL;
+            draining = true;
+            // Sockets that close as soon as they are told, such as idle keep-alive clients, must not bring the count
+            // to zero while later ones are still being counted; hold it up until the loop is done.
+            {
+                  std::lock_guard<std::mutex> sync(evHashLock);
+                  ++drainRemaining;
+            }
+            for(auto const& entry : sockets) {
+                  auto const& sock = entry.second;
+                  bool const waitFor = sock->startDrain();
+                  std::lock_guard<std::mutex> sync(evHashLock);
+                  if(waitFor && eventHash.find(sock->evId) != eventHash.end()) {
+                        sock->draining = true;
+                        ++drainRemaining;
+                  }
+            }
+            {
+                  std::lock_guard<std::mutex> sync(evHashLock);
+                  --drainRemaining;
+            }
+            logDebug("Engine::startDrain waiting for " + std::to_string(drainRemaining) + " connections");
+      }
+
+      // The drain deadline has passed; whatever is still flushing is cut off.
+      void Engine::closeDraining() {
+            std::vector<std::shared_ptr<Socket>> late;
+            {
+                  // Called once stopping is set, so workers no longer remove sockets behind our back.
+                  std::lock_guard<std::mutex> sync(evHashLock);
+                  for(auto it = eventHash.begin(); it != eventHash.end();) {
+                        if(it->second->draining) {
+                              late.push_back(it->second);
+                              it = eventHash.erase(it);
+                              --numSockets;
+                              --drainRemaining;
+                        } else {
+                              ++it;
+                        }
+                  }
+            }
+            logWarn("Engine::drain timed out, closing " + std::to_string(late.size()) + " connections");
+            std::lock_guard<std::mutex> sync(timerLock);
+            for(auto const& sock : late) {
+                  timers.cancelAllTimers(sock.get());
+                  // Pending events may still hold the socket; the peer should not wait for them.
+                  pErrorLog(::shutdown(sock->fd, SHUT_RDWR), sock->fd);
+            }
+      }
+
+      DrainProgress Engine::doDrainProgress() {
+            DrainProgress progress;
             std::lock_guard<std::mutex> sync(evHashLock);
+            progress.connections = drainRemaining;
+            for(auto const& entry : eventHash) {
+                  if(entry.second->draining) {
+                        progress.pendingBytes += entry.second->pendingBytes();
+                  }
+            }
+            return progress;
+      }
+
+      void Engine::startWorkers(int minWorkersPerCpu) {
+            std::lock_guard<std::mutex> sync(workersLock);
             int const initialNumThreadsToSpawn = std::thread::hardware_concurrency() * minWorkersPerCpu + 1;
             for(int i = 0; i < initialNumThreadsToSpawn; ++i) {
                   slaves.push_back(new Worker(Engine::doWork));
@@ -78,31 +269,50 @@ namespace Sb {
                   }
             }
             assert(!waiting, "Engine::stopWorkers failed to stop");
+            std::lock_guard<std::mutex> sync(workersLock);
             for(auto& slave : slaves) {
                   delete slave;
             }
+            slaves.clear();
+      }
+
+      // SA_RESTART keeps the watchdog's SIGPROF from failing blocking reads and writes on a worker; calls
+      // that are never restarted, such as poll, still have to retry on EINTR themselves.
+      static void setSignalHandler(int const sig, void (*handler)(int)) {
+            struct sigaction action = {};
+            action.sa_handler = handler;
+            action.sa_flags = SA_RESTART;
+            ::sigemptyset(&action.sa_mask);
+            ::sigaction(sig, &action, nullptr);
       }
 
       void Engine::doInit(int const minWorkersPerCpu) {
             assert(eventHash.size() > NUM_ENGINE_EVENTS || timerEvent, "Engine::doInit Need to Add() something before Go().");
-            std::signal(SIGPIPE, signalHandler);
+            setSignalHandler(SIGPIPE, signalHandler);
             for(int i = SIGHUP; i < _NSIG; ++i) {
-                  std::signal(i, SIG_IGN);
+                  setSignalHandler(i, SIG_IGN);
             }
-            std::signal(SIGQUIT, signalHandler);
-            std::signal(SIGINT, signalHandler);
-            std::signal(SIGTERM, signalHandler);
-            std::signal(SIGUSR1, signalHandler);
+            setSignalHandler(SIGQUIT, signalHandler);
+            setSignalHandler(SIGINT, signalHandler);
+            setSignalHandler(SIGTERM, signalHandler);
+            setSignalHandler(SIGUSR1, signalHandler);
+            setSignalHandler(SIGUSR2, signalHandler);
+            setSignalHandler(SIGPROF, signalHandler);
             startWorkers(minWorkersPerCpu);
+            startWatchdog();
             doEpoll();
             theResolver.destroy();
+            stopWatchdog();
             stopWorkers();
             for(int i = SIGHUP; i < _NSIG; ++i) {
-                  std::signal(i, SIG_DFL);
+                  setSignalHandler(i, SIG_DFL);
             }
             timerEvent.reset();
             eventHash.clear();
-            eventQueue.clear();
+            numSockets = 0;
+            for(auto& queue : eventQueues) {
+                  queue.clear();
+            }
             timers.clear();
       }
 
@@ -113,6 +323,13 @@ namespace Sb {
             Engine::theEngine->doTriggerWrites(what);
       }
 
+      void Engine::triggerReads(Socket* const what) {
+            if(Engine::theEngine == nullptr) {
+                  throw std::runtime_error("Engine::triggerReads Please call Engine::Init() first");
+            }
+            Engine::theEngine->doTriggerReads(what);
+      }
+
       void Engine::newEvent(uint64_t const evId, uint32_t const events) {
             {
                   std::lock_guard<std::mutex> sync(evHashLock);
@@ -120,10 +337,10 @@ namespace Sb {
                   if(it == eventHash.end()) {
                         return;
                   }
-                  {
-                        std::lock_guard<std::mutex> sync(eqLock);
-                        eventQueue.push_back(Event(it->second, std::bind(&Engine::run, this, it->second.get(), events)));
-                  }
+                  Event event(it->second, std::bind(&Engine::run, this, it->second.get(), events));
+                  event.evId = evId;
+                  event.events = events;
+                  queueEvent(event, it->second->priority, it->second->handlerKind(), SteadyClock::now());
             }
             sem.signal();
       }
@@ -132,21 +349,54 @@ namespace Sb {
             newEvent(what->evId, EPOLLOUT);
       }
 
-      void Engine::runAsync(Event const& event) {
+      void Engine::doTriggerReads(Socket* const what) {
+            newEvent(what->evId, EPOLLIN);
+      }
+
+      uint32_t Engine::interestMask(bool const wantIn, bool const wantOut) {
+            // A paused reader must not see RDHUP either, otherwise the unread tail is torn down with the socket.
+            return (wantIn ? EPOLLIN | EPOLLRDHUP : 0) | (wantOut ? EPOLLOUT : 0) | EPOLLONESHOT | EPOLLERR | EPOLLET;
+      }
+
+      void Engine::runAsync(Event const& event, Priority const priority) {
             if (Engine::theEngine == nullptr) {
                   throw std::runtime_error("Engine::runAsync Please call Engine::Init() first");
             }
-            Engine::theEngine->doRunAsync(event);
+            Engine::theEngine->doRunAsync(event, priority);
       }
 
-      void Engine::doRunAsync(Event const& event) {
-            {
-                  std::lock_guard<std::mutex> sync(eqLock);
-                  eventQueue.push_back(event);
-            }
+      void Engine::doRunAsync(Event const& event, Priority const priority) {
+            queueEvent(event, priority, HandlerKind::Async, SteadyClock::now());
             sem.signal();
       }
 
+      void Engine::queueEvent(Event const& event, Priority const priority, HandlerKind const kind, TimePointNs const& now) {
+            std::lock_guard<std::mutex> sync(eqLock);
+            auto& queue = eventQueues[static_cast<std::size_t>(priority)];
+            queue.push_back(event);
+            queue.back().queuedAt = now;
+            queue.back().kind = kind;
+      }
+
+      // Weighted round robin: each class may take its weight in events per round, and a round ends
+      // when no class with work has credit left. Bulk therefore gets at least one event per round.
+      bool Engine::nextEvent(Event& event) {
+            std::lock_guard<std::mutex> sync(eqLock);
+            for(int pass = 0; pass < 2; ++pass) {
+                  for(std::size_t i = 0; i < NUM_PRIORITIES; ++i) {
+                        auto& queue = eventQueues[i];
+                        if(!queue.empty() && credits[i] > 0) {
+                              --credits[i];
+                              event = std::move(queue.front());
+                              queue.pop_front();
+                              return true;
+                        }
+                  }
+                  credits = PRIORITY_WEIGHTS;
+            }
+            return false;
+      }
+
       NanoSecs Engine::setTimer(Event const& timer, NanoSecs const& timeout) {
             if(Engine::theEngine == nullptr) {
                   throw std::runtime_error("Engine::setTimer Please call Engine::Init() first");
@@ -177,13 +427,13 @@ namespace Sb {
                   std::lock_guard<std::mutex> sync(timerLock);
                   if(timerEvent) {
                         clearTimer();
-                        {
-                              std::lock_guard<std::mutex> sync(eqLock);
-                              eventQueue.push_back(*timerEvent);
-                              queued = true;
-                        }
+                        auto const now = SteadyClock::now();
+                        queueEvent(*timerEvent, Priority::Control, HandlerKind::Timer, now);
+                        queued = true;
                         timerEvent.reset();
-                        timers.handleTimerExpired();
+                        auto const due = timers.handleTimerExpired();
+                        timerLagHistogram.record(std::max<int64_t>(0, Clock::elapsed(due, now).count()));
+                        Trace::timerFired(due, now);
                   }
             }
             if(queued) {
@@ -224,36 +474,47 @@ namespace Sb {
             }
       }
 
-      void Engine::doAdd(std::shared_ptr<Socket> const& what) {
+      void Engine::doAdd(std::shared_ptr<Socket> const& what, Priority const priority) {
             if(!stopping) {
+                  what->priority = priority;
                   auto const epollOut = what->waitingOutEvent();
+                  auto const epollIn = what->waitingInEvent();
                   std::lock_guard<std::mutex> sync(evHashLock);
                   what->self = what;
                   what->evId = ++evCounter;
                   assert(eventHash.find(what->evId) == eventHash.end(), "Already cound id");
                   bool const added = eventHash.emplace(what->evId, what).second;
                   assert(added, "Already exists in hash");
-                  epoll_event event = {(epollOut ? EPOLLOUT : 0) | EPOLLONESHOT | EPOLLIN | EPOLLERR | EPOLLRDHUP | EPOLLET, {.u64 = what->evId}};
+                  ++numSockets;
+                  epoll_event event = {interestMask(epollIn, epollOut), {.u64 = what->evId}};
                   pErrorThrow(::epoll_ctl(epollFd, EPOLL_CTL_ADD, what->fd, &event), epollFd);
             }
       }
 
-      void Engine::add(std::shared_ptr<Socket> const& what) {
+      void Engine::add(std::shared_ptr<Socket> const& what, Priority const priority) {
             if(Engine::theEngine == nullptr) {
                   throw std::runtime_error("Engine::add Please call Engine::Init() first");
             }
-            theEngine->doAdd(what);
+            theEngine->doAdd(what, priority);
       }
 
       void Engine::doRemove(std::weak_ptr<Socket> const& what) {
             if(!stopping) {
                   auto const ref = what.lock();
                   if(ref) {
+                        bool drained = false;
                         {
                               std::lock_guard<std::mutex> sync(evHashLock);
                               auto it = eventHash.find(ref->evId);
                               assert(it != eventHash.end(), "Not found for removal " + std::to_string(ref->evId));
                               eventHash.erase(it);
+                              --numSockets;
+                              if(ref->draining) {
+                                    drained = --drainRemaining == 0;
+                              }
+                        }
+                        if(drained) {
+                              doStop();
                         }
                         {
                               std::lock_guard<std::mutex> sync(timerLock);
@@ -304,41 +565,67 @@ namespace Sb {
             if((events & (EPOLLIN)) != 0) {
                   sock->handleRead();
             }
-            if((events & EPOLLRDHUP) != 0 || (events & EPOLLERR) != 0) {
+            bool const failed = ((events & EPOLLRDHUP) != 0 && !sock->handlePeerClosed()) || ((events & EPOLLERR) != 0 && !sock->handleErrorQueue());
+            if(failed) {
                   sock->handleError();
                   pErrorLog(sock->getLastError(), sock->fd);
             } else {
                   bool const needOut = sock->waitingOutEvent();
-                  std::lock_guard<std::mutex> sync(evHashLock);
-                  auto const it = eventHash.find(sock->evId);
-                  if(it != eventHash.end()) {
-                        epoll_event event = {(needOut ? EPOLLOUT : 0) | EPOLLONESHOT | EPOLLIN | EPOLLERR | EPOLLRDHUP | EPOLLET, {.u64 = sock->evId}};
-                        pErrorThrow(::epoll_ctl(epollFd, EPOLL_CTL_MOD, sock->fd, &event), epollFd);
+                  bool const needIn = sock->waitingInEvent();
+                  bool rearmed = false;
+                  {
+                        std::lock_guard<std::mutex> sync(evHashLock);
+                        auto const it = eventHash.find(sock->evId);
+                        if(it != eventHash.end()) {
+                              epoll_event event = {interestMask(needIn, needOut), {.u64 = sock->evId}};
+                              pErrorThrow(::epoll_ctl(epollFd, EPOLL_CTL_MOD, sock->fd, &event), epollFd);
+                              rearmed = true;
+                        }
+                  }
+                  // Another run on this socket may have changed its needs after we sampled them and re-armed
+                  // first; our stale mask would then hide that direction for good.
+                  if(rearmed && !needIn && sock->waitingInEvent()) {
+                        doTriggerReads(sock);
+                  }
+                  if(rearmed && !needOut && sock->waitingOutEvent()) {
+                        doTriggerWrites(sock);
                   }
             }
       }
 
       void Engine::worker(Worker& me) {
+            Trace::nameThread("worker");
+            currentWorker = &me;
             try {
                   while(!stopping) {
                         sem.wait();
                         Event event({},
                         []() {
                         });
-                        {
-                              std::lock_guard<std::mutex> sync(eqLock);
-                              if(eventQueue.size() != 0) {
-                                    event = eventQueue.front();
-                                    eventQueue.pop_front();
-                              }
-                        }
+                        auto const found = nextEvent(event);
                         activeCount++;
-                        event();
+                        if(found) {
+                              auto const started = SteadyClock::now();
+                              queueWaitHistogram.record(Clock::elapsed(event.queuedAt, started).count());
+                              me.runningEvId.store(event.evId, std::memory_order_relaxed);
+                              me.runningKind.store(event.kind, std::memory_order_relaxed);
+                              me.runningSince.store(started.time_since_epoch().count(), std::memory_order_release);
+                              event();
+                              me.runningSince.store(0, std::memory_order_release);
+                              auto const ended = SteadyClock::now();
+                              handlerRunHistograms[static_cast<std::size_t>(event.kind)].record(Clock::elapsed(started, ended).count());
+                              Trace::dispatch(event.queuedAt, started, ended, event.kind, event.evId, event.events);
+                        }
                         activeCount--;
                         if(eventHash.size() == NUM_ENGINE_EVENTS && !timerEvent && activeCount == 0) {
                               doStop();
                               break;
                         }
+                        auto retire = retireRequests.load();
+                        if(retire > 0 && retireRequests.compare_exchange_strong(retire, retire - 1)) {
+                              me.retired = true;
+                              break;
+                        }
                   }
             } catch(std::exception& e) {
                   logError(std::string("Engine::worker threw a ") + e.what());
@@ -350,19 +637,172 @@ namespace Sb {
             me.exited = true;
       }
 
+      void Engine::startWatchdog() {
+            if(watchdogOptions.budget.count() <= 0) {
+                  return;
+            }
+            // The first backtrace() loads libgcc; get that done outside a signal handler.
+            void* warmUp[1];
+            ::backtrace(warmUp, 1);
+            watchdogStop = false;
+            watchdogThread = std::thread(&Engine::watchdog, this);
+      }
+
+      void Engine::stopWatchdog() {
+            if(!watchdogThread.joinable()) {
+                  return;
+            }
+            {
+                  std::lock_guard<std::mutex> sync(watchdogLock);
+                  watchdogStop = true;
+            }
+            watchdogWake.notify_all();
+            watchdogThread.join();
+      }
+
+      void Engine::watchdog() {
+            Trace::nameThread("watchdog");
+            std::vector<int64_t> flagged;
+            std::unique_lock<std::mutex> sync(watchdogLock);
+            while(!watchdogStop) {
+                  watchdogWake.wait_for(sync, watchdogOptions.checkInterval);
+                  if(watchdogStop) {
+                        break;
+                  }
+                  sync.unlock();
+                  checkWorkers(flagged);
+                  sync.lock();
+            }
+      }
+
+      // flagged holds the start time of the event last reported per worker, so each stall is logged once.
+      void Engine::checkWorkers(std::vector<int64_t>& flagged) {
+            auto const now = SteadyClock::now().time_since_epoch().count();
+            auto const budget = watchdogOptions.budget.count();
+            std::size_t stalled = 0;
+            std::lock_guard<std::mutex> sync(workersLock);
+            flagged.resize(slaves.size(), 0);
+            for(std::size_t i = slaves.size(); i-- > 0;) {
+                  if(slaves[i]->retired && slaves[i]->exited) {
+                        delete slaves[i];
+                        slaves.erase(slaves.begin() + i);
+                        flagged.erase(flagged.begin() + i);
+                        logDebug("Engine::watchdog retired a worker, " + std::to_string(slaves.size()) + " left");
+                  }
+            }
+            for(std::size_t i = 0; i < slaves.size(); ++i) {
+                  auto& worker = *slaves[i];
+                  auto const since = worker.runningSince.load(std::memory_order_acquire);
+                  if(since == 0 || now - since < budget) {
+                        continue;
+                  }
+                  ++stalled;
+                  if(flagged[i] == since) {
+                        continue;
+                  }
+                  flagged[i] = since;
+                  SlowHandler slow;
+                  slow.worker = i;
+                  slow.kind = worker.runningKind.load(std::memory_order_relaxed);
+                  slow.evId = worker.runningEvId.load(std::memory_order_relaxed);
+                  slow.elapsed = NanoSecs{now - since};
+                  slow.stack = sampleStack(worker, since);
+                  logWarn("Engine::watchdog worker " + std::to_string(i) + " has run a " + handlerKindName(slow.kind) + " handler for evId " +
+                          std::to_string(slow.evId) + " for " + std::to_string(slow.elapsed.count() / ONE_MS_IN_NS) + " ms");
+                  std::lock_guard<std::mutex> syncLog(slowLock);
+                  slowLog.push_back(slow);
+                  if(slowLog.size() > SLOW_LOG_SIZE) {
+                        slowLog.pop_front();
+                  }
+            }
+            if(watchdogOptions.compensate && stalled > extraWorkers && extraWorkers < watchdogOptions.maxExtraWorkers) {
+                  slaves.push_back(new Worker(Engine::doWork));
+                  ++extraWorkers;
+                  logWarn("Engine::watchdog " + std::to_string(stalled) + " workers stalled, added worker " + std::to_string(slaves.size() - 1));
+            } else if(stalled == 0 && extraWorkers > 0) {
+                  // Whichever worker next finishes an event leaves; the pool shrinks back one worker at a time.
+                  --extraWorkers;
+                  ++retireRequests;
+            }
+      }
+
+      std::vector<std::string> Engine::sampleStack(Worker& worker, int64_t const since) {
+            std::vector<std::string> frames;
+            worker.stackReady = false;
+            if(::pthread_kill(worker.thread.native_handle(), SIGPROF) != 0) {
+                  return frames;
+            }
+            auto const deadline = SteadyClock::now() + STACK_SAMPLE_WAIT;
+            while(!worker.stackReady && SteadyClock::now() < deadline) {
+                  std::this_thread::sleep_for(NanoSecs{100 * 1000});
+            }
+            // A stack taken after the handler returned belongs to some other event.
+            if(!worker.stackReady || worker.runningSince.load(std::memory_order_acquire) != since) {
+                  return frames;
+            }
+            auto const depth = worker.stackDepth.load();
+            auto const symbols = ::backtrace_symbols(worker.stack.data(), depth);
+            if(symbols != nullptr) {
+                  frames.assign(symbols, symbols + depth);
+                  ::free(symbols);
+            }
+            return frames;
+      }
+
       void Engine::doWork(Worker* me) noexcept {
             theEngine->worker(*me);
       }
 
       void Engine::doEpoll() {
+            Trace::nameThread("epoll");
             try {
                   while(!stopping) {
+                        if(traceDumpRequested.exchange(false)) {
+                              std::thread([]() {
+                                    Trace::dump(Trace::dumpPath());
+                              }).detach();
+                        }
+                        if(drainRequested && !draining) {
+                              startDrain();
+                        }
+                        int timeoutMs = -1;
+                        if(draining) {
+                              auto const now = SteadyClock::now();
+                              std::size_t remaining = 0;
+                              {
+                                    std::lock_guard<std::mutex> sync(evHashLock);
+                                    remaining = drainRemaining;
+                              }
+                              if(remaining == 0 || now >= drainDeadline || now >= nextDrainReport) {
+                                    auto const progress = doDrainProgress();
+                                    logDebug("Engine::drain " + std::to_string(progress.connections) + " connections and " +
+                                             std::to_string(progress.pendingBytes) + " bytes left");
+                                    if(remaining == 0 || now >= drainDeadline) {
+                                          {
+                                                std::lock_guard<std::mutex> sync(evHashLock);
+                                                stopping = true;
+                                          }
+                                          if(remaining > 0) {
+                                                closeDraining();
+                                          }
+                                          break;
+                                    }
+                                    nextDrainReport = now + DRAIN_REPORT_INTERVAL;
+                              }
+                              auto const wait = std::min(Clock::elapsed(now, drainDeadline), Clock::elapsed(now, nextDrainReport));
+                              timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+                        }
                         epoll_event epEvents[EPOLL_EVENTS_PER_RUN];
-                        int num = epoll_wait(epollFd, epEvents, EPOLL_EVENTS_PER_RUN, -1);
+                        int num = epoll_wait(epollFd, epEvents, EPOLL_EVENTS_PER_RUN, timeoutMs);
+                        Clock::tick();
                         if(stopping) {
                               break;
                         }
                         if(num >= 0) {
+                              if(num > 0) {
+                                    epollBatchHistogram.record(num);
+                                    Trace::epollWake(Clock::cached(), num);
+                              }
                               for(int i = 0; i < num; ++i) {
                                     if(epEvents[i].data.u64 == timerEvId) {
                                           handleTimerExpired();
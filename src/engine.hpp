@@ -1,4 +1,6 @@
 ﻿#pragma once
+#include <array>
+#include <condition_variable>
 #include <deque>
 #include <memory>
 #include <thread>
@@ -8,17 +10,80 @@
 #include "timers.hpp"
 #include "socket.hpp"
 #include "resolver.hpp"
+#include "histogram.hpp"
 
 namespace Sb {
+      constexpr std::size_t WORKER_STACK_DEPTH = 32;
+
+      class DrainProgress final {
+      public:
+            std::size_t connections = 0;
+            std::size_t pendingBytes = 0;
+      };
+
+      // How far behind the workers are: queued events per class, how long the oldest has waited, live
+      // sockets and armed timers.
+      class EngineLoad final {
+      public:
+            std::size_t queueDepth = 0;
+            NanoSecs queueWait{0};
+            std::size_t connections = 0;
+            std::array<std::size_t, NUM_PRIORITIES> queueDepths{{0, 0, 0}};
+            std::size_t timers = 0;
+      };
+
+      // Where time goes inside the engine, in nanoseconds except for the epoll batch sizes.
+      class EngineLatency final {
+      public:
+            HistogramSnapshot queueWait;
+            std::array<HistogramSnapshot, NUM_HANDLER_KINDS> handlerRun;
+            HistogramSnapshot epollBatch;
+            HistogramSnapshot timerLag;
+      };
+
+      // A handler running longer than budget is logged with its worker's stack; a zero budget turns the
+      // watchdog off. With compensate set, each stalled worker gets a stand-in, up to maxExtraWorkers at
+      // a time; once no worker is stalled the stand-ins are retired one per checkInterval.
+      class WatchdogOptions final {
+      public:
+            NanoSecs budget{0};
+            NanoSecs checkInterval{10 * ONE_MS_IN_NS};
+            bool compensate = false;
+            std::size_t maxExtraWorkers = 4;
+      };
+
+      class SlowHandler final {
+      public:
+            std::size_t worker = 0;
+            HandlerKind kind = HandlerKind::Other;
+            uint64_t evId = 0;
+            NanoSecs elapsed{0};
+            // Empty when the handler returned before its stack was sampled.
+            std::vector<std::string> stack;
+      };
+
       class Engine final {
       public:
             static void start(int minWorkersPerCpu = 4);
             static void stop();
+            // Stops accepting, lets the open streams flush and close, and stops once they are gone or
+            // the drain timeout expires. SIGTERM drains; SIGINT and SIGQUIT still stop at once. SIGUSR2
+            // dumps the trace rings to Trace::dumpPath().
+            static void drain();
+            static void setDrainTimeout(NanoSecs const timeout);
+            static bool isDraining();
+            static DrainProgress drainProgress();
+            static EngineLoad load();
+            static EngineLatency latency();
+            static void setWatchdog(WatchdogOptions const& options);
+            // The most recent slow handlers, oldest first.
+            static std::vector<SlowHandler> slowHandlers();
             static void init();
-            static void add(std::shared_ptr<Socket> const& what);
+            static void add(std::shared_ptr<Socket> const& what, Priority const priority = Priority::Normal);
             static void remove(std::weak_ptr<Socket> const& what);
             static void triggerWrites(Socket* const what);
-            static void runAsync(Event const& event);
+            static void triggerReads(Socket* const what);
+            static void runAsync(Event const& event, Priority const priority = Priority::Normal);
             static Resolver&resolver();
             static NanoSecs setTimer(Event const& timer, NanoSecs const&timeout);
             static NanoSecs cancelTimer(Event const& timer);
@@ -33,7 +98,18 @@ namespace Sb {
             void doEpoll(Worker* me) noexcept;
             static void doWork(Worker* me) noexcept;
             void doStop();
-            void doSignalHandler();
+            void doDrain();
+            void startDrain();
+            void closeDraining();
+            DrainProgress doDrainProgress();
+            EngineLoad doLoad();
+            EngineLatency doLatency() const;
+            void doSignalHandler(int const sig);
+            void watchdog();
+            void checkWorkers(std::vector<int64_t>& flagged);
+            std::vector<std::string> sampleStack(Worker& worker, int64_t const since);
+            void startWatchdog();
+            void stopWatchdog();
             void handleTimerExpired();
             NanoSecs doSetTimer(Event const& timer, NanoSecs const& timeout);
             NanoSecs doCancelTimer(Event const& timer);
@@ -43,10 +119,14 @@ namespace Sb {
             void run(Socket* const sock, const uint32_t events);
             void doEpoll();
             void worker(Worker&me);
-            void doAdd(std::shared_ptr<Socket> const& what);
+            void doAdd(std::shared_ptr<Socket> const& what, Priority const priority);
             void doRemove(std::weak_ptr<Socket> const& what);
             void doTriggerWrites(Socket* const what);
-            void doRunAsync(Event const& event);
+            void doTriggerReads(Socket* const what);
+            static uint32_t interestMask(bool const wantIn, bool const wantOut);
+            void doRunAsync(Event const& event, Priority const priority);
+            void queueEvent(Event const& event, Priority const priority, HandlerKind const kind, TimePointNs const& now);
+            bool nextEvent(Event& event);
             void clearTimer() const;
 
       private:
@@ -54,25 +134,54 @@ namespace Sb {
             std::mutex timerLock;
             Semaphore sem;
             std::mutex eqLock;
-            std::deque<Event> eventQueue;
+            std::array<std::deque<Event>, NUM_PRIORITIES> eventQueues;
+            std::array<unsigned, NUM_PRIORITIES> credits{{0, 0, 0}};
             std::unique_ptr<Event> timerEvent;
             bool stopping;
             std::atomic_int activeCount;
+            std::atomic<std::size_t> numSockets{0};
+            std::atomic_bool drainRequested{false};
+            std::atomic_bool draining{false};
+            std::atomic_bool traceDumpRequested{false};
+            std::size_t drainRemaining = 0;
+            NanoSecs drainTimeout = NanoSecs{30 * ONE_SEC_IN_NS};
+            TimePointNs drainDeadline;
+            TimePointNs nextDrainReport;
             std::thread::id epollTid;
             std::thread::native_handle_type epollThreadHandle;
             int epollFd = -1;
             int timerFd = -1;
+            std::mutex workersLock;
             std::vector<Worker*> slaves;
+            static thread_local Worker* currentWorker;
+            WatchdogOptions watchdogOptions;
+            std::thread watchdogThread;
+            std::mutex watchdogLock;
+            std::condition_variable watchdogWake;
+            bool watchdogStop = false;
+            std::size_t extraWorkers = 0;
+            std::atomic<std::size_t> retireRequests{0};
+            std::mutex slowLock;
+            std::deque<SlowHandler> slowLog;
             std::mutex evHashLock;
             std::map<uint64_t, std::shared_ptr<Socket>> eventHash;
             Resolver theResolver;
             Timers timers;
+            Histogram queueWaitHistogram;
+            std::array<Histogram, NUM_HANDLER_KINDS> handlerRunHistograms;
+            Histogram epollBatchHistogram;
+            Histogram timerLagHistogram;
       private:
             uint64_t const timerEvId = 0;
             uint64_t evCounter = timerEvId;
             std::size_t const NUM_ENGINE_EVENTS = 0;
             std::size_t const EPOLL_EVENTS_PER_RUN = 128;
             NanoSecs const THREAD_TERMINATE_WAIT_TIME = NanoSecs{ONE_MS_IN_NS};
+            NanoSecs const DRAIN_REPORT_INTERVAL = NanoSecs{ONE_SEC_IN_NS};
+            std::size_t const SLOW_LOG_SIZE = 64;
+            NanoSecs const STACK_SAMPLE_WAIT = NanoSecs{10 * ONE_MS_IN_NS};
+            // Events taken from each class per round while the higher classes still have work.
+            std::array<unsigned, NUM_PRIORITIES> const PRIORITY_WEIGHTS{{16, 4, 1}};
       };
 
       class Engine::Worker {
@@ -83,7 +192,17 @@ namespace Sb {
             }
 
             ~Worker();
+            std::atomic_bool exited{false};
+            // Set when the worker left to hand back a watchdog stand-in rather than because the engine stopped.
+            std::atomic_bool retired{false};
+            // Steady-clock nanoseconds at which the current event started, zero while idle.
+            std::atomic<int64_t> runningSince{0};
+            std::atomic<uint64_t> runningEvId{0};
+            std::atomic<HandlerKind> runningKind{HandlerKind::Other};
+            std::array<void*, WORKER_STACK_DEPTH> stack;
+            std::atomic<int> stackDepth{0};
+            std::atomic_bool stackReady{false};
+            // Declared last so that the worker starts after the members above are initialised.
             std::thread thread;
-            bool exited;
       };
 }
@@ -8,6 +8,23 @@ namespace Sb {
       Runnable::~Runnable() {
       }
 
+      std::string handlerKindName(HandlerKind const kind) {
+            switch(kind) {
+                  case HandlerKind::Async:
+                        return "async";
+                  case HandlerKind::Timer:
+                        return "timer";
+                  case HandlerKind::TcpStream:
+                        return "tcpstream";
+                  case HandlerKind::UdpSocket:
+                        return "udpsocket";
+                  case HandlerKind::TcpListener:
+                        return "tcplistener";
+                  default:
+                        return "other";
+            }
+      }
+
       Event::Event() {
       }
 
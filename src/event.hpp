@@ -1,13 +1,29 @@
 ﻿#pragma once
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <string>
 #include <atomic>
 #include "clock.hpp"
 
 namespace Sb {
       class Event;
 
+      // Run-queue classes. Control covers timers, name resolution and connection setup; Bulk is for
+      // transfers that may wait behind everything else but still get a share of every round.
+      enum class Priority {
+            Control = 0, Normal = 1, Bulk = 2
+      };
+      constexpr std::size_t NUM_PRIORITIES = 3;
+
+      // What an event runs, for the engine's handler run-time histograms.
+      enum class HandlerKind {
+            Async = 0, Timer = 1, TcpStream = 2, UdpSocket = 3, TcpListener = 4, Other = 5
+      };
+      constexpr std::size_t NUM_HANDLER_KINDS = 6;
+      std::string handlerKindName(HandlerKind const kind);
+
       class Runnable : public std::enable_shared_from_this<Runnable> {
       public:
             explicit Runnable();
@@ -25,5 +41,10 @@ namespace Sb {
       public:
             std::weak_ptr<Runnable> obj;
             std::function<void()> func;
+            TimePointNs queuedAt;
+            HandlerKind kind = HandlerKind::Async;
+            // The socket and epoll mask behind a socket event, for tracing.
+            uint64_t evId = 0;
+            uint32_t events = 0;
       };
 }
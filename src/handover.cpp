@@ -0,0 +1,319 @@
+﻿#include <atomic>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "logger.hpp"
+#include "engine.hpp"
+#include "handover.hpp"
+
+namespace Sb {
+      constexpr std::size_t MAX_HANDOVER_FDS = 253;
+      constexpr int HANDOVER_ACK_TIMEOUT_MS = 5000;
+      constexpr char HANDOVER_ACK = 'A';
+
+      // Waits for the successor's acknowledgement as an engine socket, so no worker blocks on it. The
+      // descriptors are only ours to close once the successor holds them.
+      class Handover::Successor final : virtual public Socket {
+      public:
+            Successor(int const connFd, std::weak_ptr<Server> const& server) : Socket(UNIX_STREAM, connFd), server(server) {
+            }
+
+            void start() {
+                  timeout = Event(self, std::bind(&Successor::timedOut, this));
+                  Engine::setTimer(timeout, NanoSecs{HANDOVER_ACK_TIMEOUT_MS * ONE_MS_IN_NS});
+            }
+
+            virtual void handleRead() override {
+                  char ack = 0;
+                  auto const got = ::recv(fd, &ack, sizeof(ack), 0);
+                  if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                        return;
+                  }
+                  finish(got == sizeof(ack) && ack == HANDOVER_ACK);
+            }
+      private:
+            void timedOut() {
+                  finish(false);
+            }
+
+            void finish(bool const acknowledged);
+
+            std::weak_ptr<Server> const server;
+            Event timeout;
+            std::atomic_bool finished{false};
+      };
+
+      // Accepts the successor and hands the published sockets over in a single message: the names,
+      // one per line and ended by an empty line, carry the descriptors in the same order. One
+      // successor at a time; another may try once the current one has failed.
+      class Handover::Server final : virtual public Socket {
+      public:
+            Server(std::string const& path) : Socket(UNIX_STREAM) {
+                  bind(path);
+                  listen(1);
+            }
+
+            virtual void handleRead() override {
+                  if(busy) {
+                        return;
+                  }
+                  InetDest peer{};
+                  auto const connFd = accept(peer);
+                  if(connFd < 0) {
+                        return;
+                  }
+                  if(!sameUser(connFd)) {
+                        logWarn("Handover::offer refusing a successor run by another user");
+                        ::close(connFd);
+                        return;
+                  }
+                  if(!theHandover().send(connFd)) {
+                        ::close(connFd);
+                        return;
+                  }
+                  busy = true;
+                  auto const successor = std::make_shared<Successor>(connFd, std::dynamic_pointer_cast<Server>(self.lock()));
+                  std::shared_ptr<Socket> ref = successor;
+                  Engine::add(ref, Priority::Control);
+                  successor->start();
+            }
+
+            virtual bool waitingInEvent() override {
+                  return !busy;
+            }
+
+            void successorDone(bool const acknowledged) {
+                  if(acknowledged) {
+                        Engine::remove(self);
+                        theHandover().handedOver();
+                  } else {
+                        busy = false;
+                        Engine::triggerReads(this);
+                  }
+            }
+      private:
+            std::atomic_bool busy{false};
+      };
+
+      void Handover::Successor::finish(bool const acknowledged) {
+            if(finished.exchange(true)) {
+                  return;
+            }
+            Engine::cancelTimer(timeout);
+            Engine::remove(self);
+            if(acknowledged) {
+                  logDebug("Handover::send sockets acknowledged");
+            } else {
+                  logError("Handover::send no acknowledgement, keeping sockets");
+            }
+            auto const ref = server.lock();
+            if(ref) {
+                  ref->successorDone(acknowledged);
+            }
+      }
+
+      Handover& Handover::theHandover() {
+            static Handover handover;
+            return handover;
+      }
+
+      bool Handover::sameUser(int const fd) {
+            struct ucred cred = {};
+            socklen_t len = sizeof(cred);
+            if(::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+                  pErrorLog(-1, fd);
+                  return false;
+            }
+            return cred.uid == ::geteuid();
+      }
+
+      std::string Handover::runtimeDir() {
+            auto const dir = "/tmp/sblade-" + std::to_string(::geteuid());
+            if(::mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+                  throw std::runtime_error("Handover::runtimeDir cannot create " + dir);
+            }
+            struct stat info = {};
+            if(::lstat(dir.c_str(), &info) < 0 || !S_ISDIR(info.st_mode) || info.st_uid != ::geteuid() || (info.st_mode & 077) != 0) {
+                  throw std::runtime_error("Handover::runtimeDir " + dir + " is not a private directory");
+            }
+            return dir;
+      }
+
+      std::size_t Handover::receive(std::string const& path) {
+            struct sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if(path.empty() || path.size() > sizeof(addr.sun_path) - 1) {
+                  throw std::runtime_error("Handover::receive bad path: " + path);
+            }
+            ::memcpy(addr.sun_path, path.data(), path.size());
+            if(path[0] == '@') {
+                  addr.sun_path[0] = '\0';
+            }
+            auto const addrLen = offsetof(struct sockaddr_un, sun_path) + path.size() + (path[0] == '@' ? 0 : 1);
+            int const fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            pErrorThrow(fd, fd);
+            // Nobody listening is the normal cold start.
+            if(::connect(fd, reinterpret_cast<struct sockaddr const*>(&addr), addrLen) < 0) {
+                  ::close(fd);
+                  return 0;
+            }
+            if(!sameUser(fd)) {
+                  logError("Handover::receive " + path + " is offered by another user, ignoring it");
+                  ::close(fd);
+                  return 0;
+            }
+            std::vector<int> fds;
+            std::string names;
+            std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS));
+            struct timeval const timeout = {HANDOVER_ACK_TIMEOUT_MS / 1000, 0};
+            pErrorLog(::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)), fd);
+            while(names != "\n" && (names.size() < 2 || names.compare(names.size() - 2, 2, "\n\n") != 0)) {
+                  char buf[MAX_PACKET_SIZE];
+                  struct iovec iov = {buf, sizeof(buf)};
+                  struct msghdr msg = {};
+                  msg.msg_iov = &iov;
+                  msg.msg_iovlen = 1;
+                  msg.msg_control = &control[0];
+                  msg.msg_controllen = control.size();
+                  auto const ret = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+                  if(ret <= 0) {
+                        pErrorLog(ret, fd);
+                        break;
+                  }
+                  for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                              auto const num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                              auto const first = fds.size();
+                              fds.resize(first + num);
+                              ::memcpy(&fds[first], CMSG_DATA(cmsg), num * sizeof(int));
+                        }
+                  }
+                  names.append(buf, ret);
+            }
+
+            auto& handover = theHandover();
+            std::size_t received = 0;
+            {
+                  std::lock_guard<std::mutex> sync(handover.lock);
+                  std::size_t begin = 0;
+                  for(auto const descriptor : fds) {
+                        auto const end = names.find('\n', begin);
+                        if(end == std::string::npos || end == begin) {
+                              ::close(descriptor);
+                              continue;
+                        }
+                        auto const name = names.substr(begin, end - begin);
+                        begin = end + 1;
+                        auto const it = handover.inherited.find(name);
+                        if(it != handover.inherited.end()) {
+                              ::close(it->second);
+                        }
+                        handover.inherited[name] = descriptor;
+                        ++received;
+                  }
+            }
+            auto const ack = HANDOVER_ACK;
+            pErrorLog(::send(fd, &ack, sizeof(ack), MSG_NOSIGNAL), fd);
+            ::close(fd);
+            logDebug("Handover::receive " + std::to_string(received) + " sockets from " + path);
+            return received;
+      }
+
+      void Handover::offer(std::string const& path, std::function<void()> const& handedOver) {
+            auto& handover = theHandover();
+            {
+                  std::lock_guard<std::mutex> sync(handover.lock);
+                  for(auto const& entry : handover.inherited) {
+                        logWarn("Handover::offer closing unclaimed " + entry.first);
+                        ::close(entry.second);
+                  }
+                  handover.inherited.clear();
+                  handover.onHandedOver = handedOver;
+            }
+            std::shared_ptr<Socket> ref = std::make_shared<Server>(path);
+            Engine::add(ref, Priority::Control);
+      }
+
+      int Handover::adopt(std::string const& name) {
+            auto& handover = theHandover();
+            std::lock_guard<std::mutex> sync(handover.lock);
+            auto const it = handover.inherited.find(name);
+            if(it == handover.inherited.end()) {
+                  return -1;
+            }
+            auto const fd = it->second;
+            handover.inherited.erase(it);
+            logDebug("Handover::adopt " + name + " fd " + std::to_string(fd));
+            return fd;
+      }
+
+      void Handover::publish(std::string const& name, std::shared_ptr<Socket> const& what) {
+            auto& handover = theHandover();
+            std::lock_guard<std::mutex> sync(handover.lock);
+            handover.listeners[name] = what;
+      }
+
+      bool Handover::send(int const connFd) {
+            std::vector<int> fds;
+            std::string names;
+            {
+                  std::lock_guard<std::mutex> sync(lock);
+                  for(auto it = listeners.begin(); it != listeners.end();) {
+                        auto const ref = it->second.lock();
+                        if(!ref) {
+                              it = listeners.erase(it);
+                              continue;
+                        }
+                        if(fds.size() < MAX_HANDOVER_FDS) {
+                              fds.push_back(ref->fd);
+                              names += it->first + "\n";
+                        } else {
+                              logWarn("Handover::send too many sockets, dropping " + it->first);
+                        }
+                        ++it;
+                  }
+            }
+            names += "\n";
+
+            std::vector<char> control(CMSG_SPACE(sizeof(int) * std::max<std::size_t>(fds.size(), 1)));
+            struct iovec iov = {&names[0], names.size()};
+            struct msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if(fds.size() > 0) {
+                  msg.msg_control = &control[0];
+                  msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+                  auto const cmsg = CMSG_FIRSTHDR(&msg);
+                  cmsg->cmsg_level = SOL_SOCKET;
+                  cmsg->cmsg_type = SCM_RIGHTS;
+                  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+                  ::memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+            }
+            auto const sent = ::sendmsg(connFd, &msg, MSG_NOSIGNAL);
+            if(sent != static_cast<ssize_t>(names.size())) {
+                  pErrorLog(sent, connFd);
+                  return false;
+            }
+
+            logDebug("Handover::send " + std::to_string(fds.size()) + " sockets");
+            return true;
+      }
+
+      void Handover::handedOver() {
+            std::map<std::string, std::weak_ptr<Socket>> handed;
+            std::function<void()> callback;
+            {
+                  std::lock_guard<std::mutex> sync(lock);
+                  handed.swap(listeners);
+                  callback = onHandedOver;
+            }
+            for(auto const& entry : handed) {
+                  Engine::remove(entry.second);
+            }
+            if(callback) {
+                  callback();
+            }
+      }
+}
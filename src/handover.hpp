@@ -0,0 +1,39 @@
+﻿#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "socket.hpp"
+
+namespace Sb {
+      // Passes listening sockets to a successor process over a Unix socket with SCM_RIGHTS so that a
+      // restart keeps the accept backlog. Sockets are named "tcp:<port>", "udp:<port>" or "unix:<path>".
+      // Both ends check that the other runs as the same user before any descriptor changes hands.
+      class Handover final {
+      public:
+            // Successor side, called before the listeners are created: fetches the predecessor's sockets
+            // and returns how many were received, zero when nobody is offering.
+            static std::size_t receive(std::string const& path);
+            // Predecessor side: serves the published sockets to the first process that connects, then
+            // stops listening on them and calls handedOver. Unclaimed inherited sockets are closed.
+            static void offer(std::string const& path, std::function<void()> const& handedOver);
+            // A 0700 directory owned by this user for the rendezvous socket; throws if it is anything else.
+            static std::string runtimeDir();
+            static int adopt(std::string const& name);
+            static void publish(std::string const& name, std::shared_ptr<Socket> const& what);
+      private:
+            class Server;
+            class Successor;
+
+            static Handover& theHandover();
+            static bool sameUser(int const fd);
+            bool send(int const connFd);
+            void handedOver();
+      private:
+            std::mutex lock;
+            std::map<std::string, int> inherited;
+            std::map<std::string, std::weak_ptr<Socket>> listeners;
+            std::function<void()> onHandedOver;
+      };
+}
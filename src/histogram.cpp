@@ -0,0 +1,87 @@
+﻿#include <algorithm>
+#include <cmath>
+#include "histogram.hpp"
+
+namespace Sb {
+      Histogram::Histogram() {
+            reset();
+      }
+
+      std::size_t Histogram::bucketOf(uint64_t const value) {
+            if(value < HISTOGRAM_SUB_BUCKETS) {
+                  return value;
+            }
+            unsigned const msb = 63 - __builtin_clzll(value);
+            unsigned const shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+            return ((shift + 1) << HISTOGRAM_SUB_BUCKET_BITS) + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+      }
+
+      uint64_t Histogram::bucketLow(std::size_t const bucket) {
+            if(bucket < HISTOGRAM_SUB_BUCKETS) {
+                  return bucket;
+            }
+            unsigned const shift = (bucket >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+            return static_cast<uint64_t>((bucket & (HISTOGRAM_SUB_BUCKETS - 1)) + HISTOGRAM_SUB_BUCKETS) << shift;
+      }
+
+      uint64_t Histogram::bucketHigh(std::size_t const bucket) {
+            if(bucket < HISTOGRAM_SUB_BUCKETS) {
+                  return bucket;
+            }
+            unsigned const shift = (bucket >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+            return bucketLow(bucket) + ((uint64_t{1} << shift) - 1);
+      }
+
+      void Histogram::record(uint64_t const value) {
+            auto& shard = shards[threadShard()];
+            shard.counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+            shard.sum.fetch_add(value, std::memory_order_relaxed);
+            auto seen = shard.max.load(std::memory_order_relaxed);
+            while(value > seen && !shard.max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+            }
+      }
+
+      HistogramSnapshot Histogram::snapshot() const {
+            HistogramSnapshot snap;
+            snap.buckets.assign(HISTOGRAM_BUCKETS, 0);
+            for(auto const& shard : shards) {
+                  for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                        auto const num = shard.counts[i].load(std::memory_order_relaxed);
+                        snap.buckets[i] += num;
+                        snap.count += num;
+                  }
+                  snap.sum += shard.sum.load(std::memory_order_relaxed);
+                  snap.max = std::max(snap.max, shard.max.load(std::memory_order_relaxed));
+            }
+            return snap;
+      }
+
+      void Histogram::reset() {
+            for(auto& shard : shards) {
+                  for(auto& count : shard.counts) {
+                        count.store(0, std::memory_order_relaxed);
+                  }
+                  shard.sum.store(0, std::memory_order_relaxed);
+                  shard.max.store(0, std::memory_order_relaxed);
+            }
+      }
+
+      uint64_t HistogramSnapshot::percentile(double const q) const {
+            if(count == 0) {
+                  return 0;
+            }
+            auto const rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+            uint64_t seen = 0;
+            for(std::size_t i = 0; i < buckets.size(); ++i) {
+                  seen += buckets[i];
+                  if(seen >= rank) {
+                        return std::min(Histogram::bucketHigh(i), max);
+                  }
+            }
+            return max;
+      }
+
+      double HistogramSnapshot::mean() const {
+            return count == 0 ? 0.0 : static_cast<double>(sum) / count;
+      }
+}
@@ -0,0 +1,51 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "utils.hpp"
+
+namespace Sb {
+      // Each power of two is split into 2^HISTOGRAM_SUB_BUCKET_BITS linear buckets, which bounds the
+      // relative error of a recorded value to 1/16 over the whole uint64_t range.
+      constexpr unsigned HISTOGRAM_SUB_BUCKET_BITS = 4;
+      constexpr std::size_t HISTOGRAM_SUB_BUCKETS = std::size_t{1} << HISTOGRAM_SUB_BUCKET_BITS;
+      constexpr std::size_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+      class HistogramSnapshot final {
+      public:
+            // The upper bound of the bucket holding the q-th quantile, q in [0, 1].
+            uint64_t percentile(double const q) const;
+            double mean() const;
+      public:
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            uint64_t max = 0;
+            std::vector<uint64_t> buckets;
+      };
+
+      // A log-linear (HDR style) histogram. Each thread records into its own shard with relaxed
+      // atomics, so recording never blocks; snapshot() adds the shards up when someone asks.
+      class Histogram final {
+      public:
+            Histogram();
+            Histogram(Histogram const&) = delete;
+            Histogram& operator=(Histogram const&) = delete;
+            void record(uint64_t const value);
+            HistogramSnapshot snapshot() const;
+            void reset();
+            static std::size_t bucketOf(uint64_t const value);
+            static uint64_t bucketLow(std::size_t const bucket);
+            static uint64_t bucketHigh(std::size_t const bucket);
+      private:
+            class Shard final {
+            public:
+                  std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> counts;
+                  std::atomic<uint64_t> sum;
+                  std::atomic<uint64_t> max;
+            };
+
+      private:
+            std::array<Shard, THREAD_SHARDS> shards;
+      };
+}
@@ -6,9 +6,16 @@
 #include "udpsocket.hpp"
 #include "tcplistener.hpp"
 #include "tcpconn.hpp"
+#include "connpool.hpp"
+#include "handover.hpp"
+#include "statsserver.hpp"
 #include <random>
 
 using namespace Sb;
+// A filesystem path lets the successor bind its own offer while we still hold ours; it lives in
+// Handover::runtimeDir() so that no other user can stand in for either side.
+static std::string const HANDOVER_NAME = "handover";
+static uint16_t const STATS_PORT = 9464;
 namespace Sb {
       extern size_t test_ocb();
 }
@@ -147,40 +154,211 @@ public:
       virtual void received(const Bytes& x) override;
       virtual void writeComplete() override;
       virtual void disconnected() override;
+      virtual void peerClosedWrite() override;
+      virtual void drain() override;
       virtual void disconnect();
+      virtual void writeBlocked() override;
+      virtual void writeUnblocked() override;
       virtual void queueWrite(Bytes const& x);
       virtual void disconnectRemote() const;
+      virtual void abortRemote() const;
+      void responseComplete();
+      void pauseReading();
+      void resumeReading();
 private:
       Bytes header;
       std::weak_ptr<Remote> ep;
       InetDest remoteDest;
-      bool disconnectWhenCompleted = false;
+      bool keepAlive = false;
+      bool clientClosed = false;
       std::mutex lock;
 };
 
+// Follows an HTTP/1.x response just far enough to find where it ends, so that the upstream
+// connection goes back to the pool only after the whole response has been relayed.
+class ResponseFraming final {
+public:
+      // A CONNECT tunnel carries no HTTP framing of its own and only ends when either side closes.
+      ResponseFraming(bool const headRequest, bool const tunnel) : headRequest(headRequest), state(tunnel ? State::UntilClose : State::StatusLine) {
+      }
+
+      // Consumes the start of x that still belongs to the response and returns its length.
+      std::size_t feed(Bytes const& x) {
+            std::size_t pos = 0;
+            while(pos < x.size() && state != State::Done) {
+                  if(state == State::UntilClose) {
+                        pos = x.size();
+                  } else if(state == State::Body || state == State::ChunkData) {
+                        auto const take = std::min<std::size_t>(remaining, x.size() - pos);
+                        pos += take;
+                        remaining -= take;
+                        if(remaining == 0) {
+                              state = state == State::Body ? State::Done : State::ChunkDataEnd;
+                        }
+                  } else {
+                        auto const c = x[pos++];
+                        if(c != '\n') {
+                              if(c != '\r' && line.size() < MAX_LINE) {
+                                    line.push_back(::tolower(c));
+                              }
+                        } else {
+                              endOfLine();
+                              line.clear();
+                        }
+                  }
+            }
+            return pos;
+      }
+
+      bool done() const {
+            return state == State::Done;
+      }
+
+      // The response ended where its framing said and did not ask for the connection to close.
+      bool reusable() const {
+            return done() && !closeAfter;
+      }
+
+private:
+      enum class State {
+            StatusLine, Header, Body, ChunkSize, ChunkData, ChunkDataEnd, Trailer, Done, UntilClose
+      };
+      static std::size_t const MAX_LINE = 8192;
+
+      // The three digits after the version; the reason phrase may be empty or missing. 0 if malformed.
+      int statusCode() const {
+            auto const space = line.find(' ');
+            if(space == std::string::npos || line.size() < space + 4 || (line.size() > space + 4 && line[space + 4] != ' ')) {
+                  return 0;
+            }
+            int code = 0;
+            for(std::size_t i = space + 1; i < space + 4; ++i) {
+                  if(line[i] < '0' || line[i] > '9') {
+                        return 0;
+                  }
+                  code = code * 10 + (line[i] - '0');
+            }
+            return code;
+      }
+
+      void endOfLine() {
+            switch(state) {
+            case State::StatusLine:
+                  status = statusCode();
+                  closeAfter = line.compare(0, 9, "http/1.1 ") != 0;
+                  chunked = false;
+                  length = -1;
+                  state = State::Header;
+                  break;
+            case State::Header:
+                  if(line.size() == 0) {
+                        endOfHeader();
+                  } else if(line.compare(0, 15, "content-length:") == 0) {
+                        length = std::atoll(line.c_str() + 15);
+                  } else if(line.compare(0, 18, "transfer-encoding:") == 0) {
+                        chunked = line.find("chunked") != std::string::npos;
+                  } else if(line.compare(0, 11, "connection:") == 0) {
+                        closeAfter = closeAfter || line.find("close") != std::string::npos;
+                  }
+                  break;
+            case State::ChunkSize: {
+                  char* end = nullptr;
+                  remaining = std::strtoull(line.c_str(), &end, 16);
+                  if(end == line.c_str()) {
+                        closeAfter = true;
+                        state = State::UntilClose;
+                  } else {
+                        state = remaining == 0 ? State::Trailer : State::ChunkData;
+                  }
+                  break;
+            }
+            case State::ChunkDataEnd:
+                  state = State::ChunkSize;
+                  break;
+            case State::Trailer:
+                  if(line.size() == 0) {
+                        state = State::Done;
+                  }
+                  break;
+            default:
+                  break;
+            }
+      }
+
+      void endOfHeader() {
+            if(status >= 100 && status < 200 && status != 101) {
+                  state = State::StatusLine;
+            } else if(status == 0 || status == 101) {
+                  closeAfter = true;
+                  state = State::UntilClose;
+            } else if(headRequest || status == 204 || status == 304) {
+                  state = State::Done;
+            } else if(chunked) {
+                  state = State::ChunkSize;
+            } else if(length > 0) {
+                  remaining = length;
+                  state = State::Body;
+            } else if(length == 0) {
+                  state = State::Done;
+            } else {
+                  closeAfter = true;
+                  state = State::UntilClose;
+            }
+      }
+
+private:
+      bool const headRequest;
+      State state;
+      std::string line;
+      int status = 0;
+      long long length = -1;
+      bool chunked = false;
+      bool closeAfter = false;
+      std::size_t remaining = 0;
+};
+
 class Remote : public TcpStreamIf {
 public:
-      Remote(const std::weak_ptr<HttpProxy> ep, Bytes& initWrite) : ep(ep), initWrite(initWrite) {
+      // requestBody is how many bytes past the header the request carries; anything beyond it is a
+      // pipelined request, and a connection with one in flight is not handed back to the pool.
+      Remote(const std::weak_ptr<HttpProxy> ep, Bytes& initWrite, Priority const priority, bool const poolable, bool const headRequest,
+             bool const tunnel, std::size_t const requestBody) : ep(ep), initWrite(initWrite), priority(priority), poolable(poolable),
+            response(headRequest, tunnel), requestLeft(requestBody) {
       }
 
       virtual ~Remote() {
       }
 
       virtual void disconnect() {
-            assert(!epDisconnected, "Already disconnected");
+            std::lock_guard<std::mutex> sync(lock);
             epDisconnected = true;
             auto ref = tcpStream.lock();
-            if(ref) {
-                  if(ref->writeQueueEmpty() && epDisconnected) {
-                        ref->disconnect();
-                  }
+            if(ref && initWrite.size() == 0) {
+                  ref->shutdownWrite();
             }
       }
 
       virtual void received(const Bytes& x) override {
             auto ref = ep.lock();
+            auto const wasDone = response.done();
+            auto const used = response.feed(x);
+            if(used < x.size() && poolable) {
+                  // The upstream sent more than the response it owed; do not relay or reuse it.
+                  poolable = false;
+                  if(ref && used > 0) {
+                        ref->queueWrite(Bytes(x.begin(), x.begin() + used));
+                  }
+                  if(!wasDone && ref) {
+                        ref->responseComplete();
+                  }
+                  abort();
+                  return;
+            }
             if(ref) {
                   ref->queueWrite(x);
+                  if(!wasDone && response.done()) {
+                        ref->responseComplete();
+                  }
             }
       }
 
@@ -191,21 +369,103 @@ public:
             }
       }
 
+      virtual void peerClosedWrite() override {
+            auto ref = ep.lock();
+            if(ref) {
+                  ref->disconnect();
+            }
+      }
+
+      // The client side decides when the exchange is over.
+      virtual void drain() override {
+      }
+
       virtual void writeComplete() override {
             std::lock_guard<std::mutex> sync(lock);
             auto ref = tcpStream.lock();
             if(ref) {
+                  if(!prioritySet && ref->didConnect()) {
+                        prioritySet = true;
+                        ref->setPriority(priority);
+                  }
                   if(initWrite.size() > 0) {
                         ref->queueWrite(initWrite);
                         initWrite.resize(0);
-                  } else if(epDisconnected) {
-                        ref->disconnect();
                   }
+                  if(epDisconnected) {
+                        ref->shutdownWrite();
+                  }
+            }
+      }
+
+      virtual void writeBlocked() override {
+            auto ref = ep.lock();
+            if(ref) {
+                  ref->pauseReading();
+            }
+      }
+
+      virtual void writeUnblocked() override {
+            auto ref = ep.lock();
+            if(ref) {
+                  ref->resumeReading();
+            }
+      }
+
+      // The client is gone; nothing else will be sent or read on the upstream.
+      void abort() {
+            std::lock_guard<std::mutex> sync(lock);
+            epDisconnected = true;
+            auto ref = tcpStream.lock();
+            if(ref) {
+                  ref->disconnect();
+            }
+      }
+
+      bool reusable() const {
+            return poolable && response.reusable();
+      }
+
+      // The response has been relayed and no further request is riding on this connection.
+      bool idle() {
+            std::lock_guard<std::mutex> sync(lock);
+            return response.done() && !pipelined;
+      }
+
+      void release() {
+            std::lock_guard<std::mutex> sync(lock);
+            epDisconnected = true;
+            auto ref = tcpStream.lock();
+            if(ref) {
+                  // We get here from the upstream's own read callback, which holds the read lock that
+                  // rebinding the stream needs.
+                  Engine::runAsync(Event(ref, [ref]() {
+                        ConnectionPool::release(ref);
+                  }), Priority::Control);
+            }
+      }
+
+      void pauseReading() {
+            auto ref = tcpStream.lock();
+            if(ref) {
+                  ref->pauseReading();
+            }
+      }
+
+      void resumeReading() {
+            auto ref = tcpStream.lock();
+            if(ref) {
+                  ref->resumeReading();
             }
       }
 
       void doWrite(const Bytes& x) {
             std::lock_guard<std::mutex> sync(lock);
+            if(x.size() > requestLeft) {
+                  poolable = false;
+                  pipelined = true;
+            }
+            requestLeft -= std::min(requestLeft, x.size());
             auto ref = tcpStream.lock();
             if(ref) {
                   if(initWrite.size() > 0) {
@@ -223,12 +483,19 @@ private:
       Bytes initWrite;
       std::mutex lock;
       bool epDisconnected = false;
+      Priority const priority;
+      bool prioritySet = false;
+      std::atomic<bool> poolable;
+      ResponseFraming response;
+      std::size_t requestLeft;
+      bool pipelined = false;
 };
 
 HttpProxy::~HttpProxy() {
 }
 
 void HttpProxy::received(const Bytes& x) {
+      std::lock_guard<std::mutex> sync(lock);
       auto ref = ep.lock();
       if(ref) {
             ref->doWrite(x);
@@ -288,12 +555,37 @@ void HttpProxy::received(const Bytes& x) {
             port = 443;
       };
 
-      auto sp = std::make_shared<Remote>(std::dynamic_pointer_cast<HttpProxy>(shared_from_this()), header);
-      TcpConnection::create(host, port, sp);
+      auto const http11 = findFirstPattern(header.begin(), header.end(), {'H', 'T', 'T', 'P', '/', '1', '.', '1'});
+      auto const close = findFirstPattern(header.begin(), header.end(), {'C', 'o', 'n', 'n', 'e', 'c', 't', 'i', 'o', 'n', ':', ' ', 'c', 'l', 'o', 's', 'e'});
+      keepAlive = port == 80 && http11.first != http11.second && close.first == close.second;
+      if(keepAlive && Engine::isDraining()) {
+            // Both ends learn that this is the connection's last exchange.
+            keepAlive = false;
+            Bytes const last{'C', 'o', 'n', 'n', 'e', 'c', 't', 'i', 'o', 'n', ':', ' ', 'c', 'l', 'o', 's', 'e', '\r', '\n'};
+            header.insert(doubleCr.second - 1, last.begin(), last.end());
+      }
+      // Tunnels are bulk transfers; plain requests stay ahead of them.
+      auto const priority = port == 443 ? Priority::Bulk : Priority::Normal;
+      bool const headRequest = header.size() > 5 && std::equal(header.begin(), header.begin() + 5, "HEAD ");
+      std::size_t requestBody = 0;
+      auto const headerEnd = findFirstPattern(header.begin(), header.end(), {'\r', '\n', '\r', '\n'}).second;
+      auto const length = findFirstPattern(header.begin(), headerEnd, {'\n', 'C', 'o', 'n', 't', 'e', 'n', 't', '-', 'L', 'e', 'n', 'g', 't', 'h', ':'});
+      if(length.first != length.second) {
+            requestBody = std::strtoull(std::string(length.second + 1, headerEnd).c_str(), nullptr, 10);
+      }
+      auto const chunked = findFirstPattern(header.begin(), headerEnd, {'c', 'h', 'u', 'n', 'k', 'e', 'd'});
+      // The bytes that came in with the header are part of the body we count.
+      auto const extra = headerEnd == header.end() ? 0 : static_cast<std::size_t>(header.end() - headerEnd - 1);
+      bool const poolable = keepAlive && chunked.first == chunked.second && extra <= requestBody;
+      requestBody -= std::min(requestBody, extra);
+      auto sp = std::make_shared<Remote>(std::dynamic_pointer_cast<HttpProxy>(shared_from_this()), header, priority, poolable, headRequest,
+                                         port == 443, requestBody);
+      TcpConnection::create(host, port, sp, header.size() > 0);
       ep = sp;
       if(port == 443) {
             auto ref = tcpStream.lock();
             if(ref) {
+                  ref->setPriority(priority);
                   ref->queueWrite({'H', 'T', 'T', 'P', '/', '1', '.', '1', ' ', '2', '0', '0', ' ', 'O', 'K', '\n', '\n'});
             }
       } else {
@@ -309,27 +601,68 @@ void HttpProxy::writeComplete() {
                   remoteDest = ref->endPoint();
             }
       }
-      if(disconnectWhenCompleted) {
+}
+
+// An upstream still owing part of a response is of no use to anybody else.
+void HttpProxy::disconnected() {
+      std::lock_guard<std::mutex> sync(lock);
+      abortRemote();
+}
+
+// The client is done sending but still waits for the response; pass the half-close upstream.
+void HttpProxy::peerClosedWrite() {
+      std::lock_guard<std::mutex> sync(lock);
+      clientClosed = true;
+      if(ep.expired()) {
             auto tcpRef = tcpStream.lock();
             if(tcpRef) {
-                  tcpRef->disconnect();
+                  tcpRef->shutdownWrite();
             }
+      } else {
+            disconnectRemote();
       }
 }
 
-void HttpProxy::disconnected() {
+// The upstream has delivered a whole response. Hand it back to the pool if it can take another
+// request and the client may send one; the next request from the client then starts afresh.
+void HttpProxy::responseComplete() {
       std::lock_guard<std::mutex> sync(lock);
-      disconnectRemote();
+      auto ref = ep.lock();
+      if(!ref) {
+            return;
+      }
+      if(clientClosed || Engine::isDraining()) {
+            // Draining stops keep-alive: this was the connection's last exchange.
+            ref->abort();
+            ep.reset();
+            disconnect();
+      } else if(ref->reusable()) {
+            ep.reset();
+            header.clear();
+            ref->release();
+      }
+}
+
+// Clients between exchanges are closed now; one with a request in flight closes once its response
+// is through (see responseComplete).
+void HttpProxy::drain() {
+      std::lock_guard<std::mutex> sync(lock);
+      auto ref = ep.lock();
+      if(!ref || ref->idle()) {
+            if(ref) {
+                  ref->abort();
+            }
+            auto tcpRef = tcpStream.lock();
+            if(tcpRef) {
+                  tcpRef->disconnect();
+            }
+      }
 }
 
 void HttpProxy::disconnect() {
       auto tcpRef = tcpStream.lock();
       if(tcpRef) {
-            if(tcpRef->writeQueueEmpty()) {
-                  tcpRef->disconnect();
-            } else {
-                  disconnectWhenCompleted = true;
-            }
+            tcpRef->shutdownWrite();
       }
 }
 
@@ -340,6 +673,41 @@ void HttpProxy::queueWrite(Bytes const& x) {
       }
 }
 
+void HttpProxy::writeBlocked() {
+      auto ref = ep.lock();
+      if(ref) {
+            ref->pauseReading();
+      }
+}
+
+void HttpProxy::writeUnblocked() {
+      auto ref = ep.lock();
+      if(ref) {
+            ref->resumeReading();
+      }
+}
+
+void HttpProxy::pauseReading() {
+      auto tcpRef = tcpStream.lock();
+      if(tcpRef) {
+            tcpRef->pauseReading();
+      }
+}
+
+void HttpProxy::resumeReading() {
+      auto tcpRef = tcpStream.lock();
+      if(tcpRef) {
+            tcpRef->resumeReading();
+      }
+}
+
+void HttpProxy::abortRemote() const {
+      auto ref = ep.lock();
+      if(ref) {
+            ref->abort();
+      }
+}
+
 void HttpProxy::disconnectRemote() const {
       auto ref = ep.lock();
       if(ref) {
@@ -467,15 +835,39 @@ int main(const int, const char* const argv[]) {
 //                  return std::make_shared<TcpSink>();
 //            });
 //      });
+//      runUnit("echounix", []() {
+//            TcpListener::create(std::string("@sblade-echo"), []() {
+//                  return std::make_shared<TcpEcho>();
+//            });
+//      });
+//      runUnit("sinkunix", []() {
+//            TcpListener::create(std::string("@sblade-sink"), []() {
+//                  return std::make_shared<TcpSink>();
+//            });
+//      });
+//      runUnit("echounixudp", []() {
+//            std::shared_ptr<UdpSocketIf> ref = std::make_shared<EchoUdp>();
+//            UdpSocket::create(std::string("@sblade-dgram"), ref);
+//      });
 //      runUnit("splattcp", []() {
 //            TcpListener::create(1024, []() {
 //                  return std::make_shared<TcpSplat>();
 //            });
 //      });
       runUnit("httpproxy", []() {
+            auto const handoverPath = Handover::runtimeDir() + "/" + HANDOVER_NAME;
+            Handover::receive(handoverPath);
             TcpListener::create(1024, []() {
                   return std::make_shared<HttpProxy>();
             });
+            StatsServer::create(STATS_PORT);
+            WatchdogOptions watchdog;
+            watchdog.budget = NanoSecs{100 * ONE_MS_IN_NS};
+            watchdog.compensate = true;
+            Engine::setWatchdog(watchdog);
+            Handover::offer(handoverPath, []() {
+                  Engine::drain();
+            });
       });
       return 0;
 }
@@ -0,0 +1,78 @@
+﻿#include <algorithm>
+#include "ratelimiter.hpp"
+
+namespace Sb {
+      std::shared_ptr<RateLimiter> RateLimiter::create(bitsPerSecond const rate, std::size_t const burst, std::shared_ptr<RateLimiter> const& parent) {
+            return std::make_shared<RateLimiter>(rate, burst, parent);
+      }
+
+      RateLimiter::RateLimiter(bitsPerSecond const rate, std::size_t const burst, std::shared_ptr<RateLimiter> const& parent)
+                  : parent(parent), rate(0), burstNs(0), theoreticalArrival(0) {
+            setRate(rate, burst);
+      }
+
+      std::shared_ptr<RateLimiter> RateLimiter::child(bitsPerSecond const rate, std::size_t const burst) {
+            return create(rate, burst, shared_from_this());
+      }
+
+      std::size_t RateLimiter::defaultBurst(bitsPerSecond const rate) {
+            return std::max<std::size_t>(rate / 10, 16 * MAX_PACKET_SIZE);
+      }
+
+      void RateLimiter::setRate(bitsPerSecond const newRate, std::size_t const burst) {
+            rate = newRate;
+            burstNs = newRate == 0 ? 0 : static_cast<int64_t>((burst == 0 ? defaultBurst(newRate) : burst) * ONE_SEC_IN_NS / newRate);
+      }
+
+      std::shared_ptr<RateLimiter> const& RateLimiter::getParent() const {
+            return parent;
+      }
+
+      int64_t RateLimiter::cost(std::size_t const bytes) const {
+            bitsPerSecond const current = rate.load(std::memory_order_relaxed);
+            return current == 0 ? 0 : static_cast<int64_t>(bytes * ONE_SEC_IN_NS / current);
+      }
+
+      int64_t RateLimiter::take(std::size_t const bytes, int64_t const now) {
+            auto const increment = cost(bytes);
+            if(increment == 0) {
+                  return 0;
+            }
+            // A request larger than the burst is let through once the bucket is full.
+            auto const allowance = std::max(burstNs.load(std::memory_order_relaxed), increment);
+            auto arrival = theoreticalArrival.load(std::memory_order_relaxed);
+            for(; ;) {
+                  auto const next = std::max(arrival, now) + increment;
+                  auto const wait = next - now - allowance;
+                  if(wait > 0) {
+                        return wait;
+                  } else if(theoreticalArrival.compare_exchange_weak(arrival, next, std::memory_order_relaxed)) {
+                        return 0;
+                  }
+            }
+      }
+
+      void RateLimiter::giveBack(std::size_t const bytes) {
+            theoreticalArrival.fetch_sub(cost(bytes), std::memory_order_relaxed);
+      }
+
+      NanoSecs RateLimiter::acquire(std::size_t const bytes) {
+            auto const now = Clock::now();
+            for(auto level = this; level != nullptr; level = level->parent.get()) {
+                  auto const wait = level->take(bytes, now);
+                  if(wait > 0) {
+                        for(auto granted = this; granted != level; granted = granted->parent.get()) {
+                              granted->giveBack(bytes);
+                        }
+                        return NanoSecs{wait};
+                  }
+            }
+            return NanoSecs{0};
+      }
+
+      void RateLimiter::release(std::size_t const bytes) {
+            for(auto level = this; level != nullptr; level = level->parent.get()) {
+                  level->giveBack(bytes);
+            }
+      }
+}
@@ -0,0 +1,32 @@
+﻿#pragma once
+#include <atomic>
+#include <memory>
+#include "clock.hpp"
+#include "types.hpp"
+
+namespace Sb {
+      // A token bucket that can be chained to a parent (global -> listener -> client -> stream).
+      // Buckets are lock free: each keeps a theoretical arrival time (GCRA) which is advanced
+      // with a compare and swap; a grant must succeed at every level or it is rolled back.
+      class RateLimiter final : public std::enable_shared_from_this<RateLimiter> {
+      public:
+            static std::shared_ptr<RateLimiter> create(bitsPerSecond const rate, std::size_t const burst = 0,
+                                                       std::shared_ptr<RateLimiter> const& parent = nullptr);
+            RateLimiter(bitsPerSecond const rate, std::size_t const burst, std::shared_ptr<RateLimiter> const& parent);
+            std::shared_ptr<RateLimiter> child(bitsPerSecond const rate, std::size_t const burst = 0);
+            NanoSecs acquire(std::size_t const bytes);
+            void release(std::size_t const bytes);
+            void setRate(bitsPerSecond const rate, std::size_t const burst = 0);
+            std::shared_ptr<RateLimiter> const& getParent() const;
+            static std::size_t defaultBurst(bitsPerSecond const rate);
+      private:
+            int64_t take(std::size_t const bytes, int64_t const now);
+            void giveBack(std::size_t const bytes);
+            int64_t cost(std::size_t const bytes) const;
+      private:
+            std::shared_ptr<RateLimiter> const parent;
+            std::atomic<bitsPerSecond> rate;
+            std::atomic<int64_t> burstNs;
+            std::atomic<int64_t> theoreticalArrival;
+      };
+}
@@ -3,6 +3,10 @@
 #include "engine.hpp"
 
 namespace Sb {
+      void ResolverIf::resolvedAll(std::vector<IpAddr> const& addrs) {
+            resolved(addrs.front());
+      }
+
       Resolver::Resolver() {
       }
 
@@ -30,6 +34,10 @@ namespace Sb {
             }
       }
 
+      ResolverStats Resolver::stats() const {
+            return impl ? impl->stats() : ResolverStats();
+      }
+
       void Resolver::destroy() {
             if(impl) {
                   impl.reset();
@@ -2,6 +2,7 @@
 #include <string>
 #include <memory>
 #include <mutex>
+#include <vector>
 #include "clock.hpp"
 #include "types.hpp"
 #include "socket.hpp"
@@ -11,10 +12,21 @@ namespace Sb {
       public:
             virtual void notResolved() = 0;
             virtual void resolved(IpAddr const&addr) = 0;
+            virtual void resolvedAll(std::vector<IpAddr> const& addrs);
       };
 
       class ResolverImpl;
 
+      class ResolverStats final {
+      public:
+            double hitRate() const {
+                  return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+            }
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            std::size_t cachedNames = 0;
+      };
+
       class Resolver final {
       public:
             friend class Engine;
@@ -26,6 +38,7 @@ namespace Sb {
             void resolve(std::shared_ptr<ResolverIf> const& client, std::string const&, AddrPref const&prefs = AddrPref::AnyAddr,
             NanoSecs const& timeout = NanoSecs{2000000000}, InetDest const& nameServer = Socket::destFromString("::1", 53));
             void cancel(const ResolverIf* client);
+            ResolverStats stats() const;
       private:
             void destroy();
             Resolver();
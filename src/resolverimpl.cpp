@@ -1,4 +1,5 @@
-﻿#include <utility>
+﻿#include <algorithm>
+#include <utility>
 #include "resolverimpl.hpp"
 #include "engine.hpp"
 
@@ -90,6 +91,26 @@ namespace Sb {
             return found;
       }
 
+      bool ResolverImpl::Names::getAll(Resolver::AddrPref const&prefs, std::vector<IpAddr>&all) const {
+            all.clear();
+            IpAddr first;
+            if (!get(prefs, first)) {
+                  return false;
+            }
+            auto const start = lastAccessIndex;
+            for (size_t n = 0; n < addrs.size(); ++n) {
+                  auto const& addr = addrs[(start + n) % addrs.size()];
+                  auto const isIpv4 = addr.isIpv4Addr();
+                  if (prefs == Resolver::AddrPref::AnyAddr || (isIpv4 && prefs == Resolver::AddrPref::Ipv4Only) ||
+                      (!isIpv4 && prefs == Resolver::AddrPref::Ipv6Only)) {
+                        if (std::find_if(all.begin(), all.end(), [&addr](IpAddr const& seen) { return seen.d == addr.d; }) == all.end()) {
+                              all.push_back(addr);
+                        }
+                  }
+            }
+            return true;
+      }
+
       void ResolverImpl::Names::put(const Query::Qanswer&ans) {
             logDebug("Resolver::put " + std::to_string(ans.addr.size()));
             for (const auto&addr : ans.addr) {
@@ -102,25 +123,27 @@ namespace Sb {
             std::lock_guard<std::mutex> sync(lock);
             auto it = byName.find(name);
             if (it != byName.end()) {
-                  IpAddr addr;
-                  if (it->second.get(prefs, addr)) {
-                        client->resolved(addr);
+                  hits.fetch_add(1, std::memory_order_relaxed);
+                  std::vector<IpAddr> addrs;
+                  if (it->second.getAll(prefs, addrs)) {
+                        client->resolvedAll(addrs);
                   } else {
                         client->notResolved();
                   }
             } else {
+                  misses.fetch_add(1, std::memory_order_relaxed);
                   logDebug("adding request " + std::to_string(request));
                   resQueries[request] = {prefs, {}, {}, Event(shared_from_this(), std::bind(&ResolverImpl::queryTimedout, this, request))};
                   resQueries[request].prefs = prefs;
                   if (prefs != Resolver::AddrPref::Ipv4Only) {
                         std::shared_ptr<UdpSocketIf> resolver = std::make_shared<UdpResolver>(*this, request, name, Query::Qtype::Aaaa);
-                        UdpSocket::create(nameServer, resolver);
+                        UdpSocket::create(nameServer, resolver, Priority::Control);
                         resQueries[request].clients.push_back(client);
                   }
                   if (prefs != Resolver::AddrPref::Ipv6Only) {
                         std::shared_ptr<UdpSocketIf> resolver = std::make_shared<UdpResolver>(*this, request, name, Query::Qtype::A);
                         resQueries[request].resolvers.push_back(resolver);
-                        UdpSocket::create(nameServer, resolver);
+                        UdpSocket::create(nameServer, resolver, Priority::Control);
                         resQueries[request].clients.push_back(client);
                   }
                   Engine::setTimer(resQueries[request].timeout, timeout);
@@ -128,6 +151,15 @@ namespace Sb {
             }
       }
 
+      ResolverStats ResolverImpl::stats() {
+            ResolverStats stats;
+            stats.hits = hits.load(std::memory_order_relaxed);
+            stats.misses = misses.load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> sync(lock);
+            stats.cachedNames = byName.size();
+            return stats;
+      }
+
       void ResolverImpl::cancel(ResolverIf const * /*client*/) {
             std::lock_guard<std::mutex> sync(lock);
             //          auto it = byName.find(&name);
@@ -163,7 +195,7 @@ namespace Sb {
             logDebug("ResolverImpl::requestComplete " + std::to_string(ans.reqNo));
             std::shared_ptr<ResolverIf> client;
             Resolver::AddrPref prefs;
-            IpAddr ipAddr;
+            std::vector<IpAddr> ipAddrs;
             bool requestComplete = false;
             bool completedError = true;
             {
@@ -194,7 +226,7 @@ namespace Sb {
                               logDebug("name not found at all " + ans.name);
                               completedError = true;
                         } else {
-                              if (bn->second.get(prefs, ipAddr)) {
+                              if (bn->second.getAll(prefs, ipAddrs)) {
                                     completedError = false;
                               } else {
                                     logDebug("name not found " + ans.name);
@@ -211,8 +243,8 @@ namespace Sb {
                         logDebug("request complete with error " + std::to_string(ans.reqNo));
                         client->notResolved();
                   } else {
-                        logDebug("request complete as " + ipAddr.toString() + " " + std::to_string(ans.reqNo));
-                        client->resolved(ipAddr);
+                        logDebug("request complete as " + ipAddrs.front().toString() + " " + std::to_string(ans.reqNo));
+                        client->resolvedAll(ipAddrs);
                   }
             } else {
                   logDebug("request inComplete " + std::to_string(ans.reqNo));
@@ -1,4 +1,5 @@
 ﻿#pragma once
+#include <atomic>
 #include <functional>
 #include <unordered_map>
 #include <map>
@@ -31,10 +32,12 @@ namespace Sb {
             void requestComplete(uint16_t const reqNo, Query::Qanswer const& ans) override;
             void requestError(uint16_t const reqNo) override;
             void queryTimedout(uint16_t const reqNo);
+            ResolverStats stats();
       private:
             class Names {
             public:
                   bool get(const Resolver::AddrPref& prefs, IpAddr& addr) const;
+                  bool getAll(const Resolver::AddrPref& prefs, std::vector<IpAddr>& all) const;
                   void put(const Query::Qanswer& ans);
                   mutable size_t lastAccessIndex;
                   std::vector<TimePointNs> expiry;
@@ -54,5 +57,7 @@ namespace Sb {
             std::map<TimePointNs, std::string const*> byExpiry;
             std::mutex lock;
             uint16_t request;
+            std::atomic<uint64_t> hits{0};
+            std::atomic<uint64_t> misses{0};
       };
 }
\ No newline at end of file
@@ -1,9 +1,16 @@
 ﻿#include <arpa/inet.h>
-#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <unistd.h>
 #include <string.h>
+#include <cstddef>
+#include <algorithm>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
 #include "socket.hpp"
 
 namespace Sb {
@@ -11,17 +18,66 @@ namespace Sb {
       typedef union {
             struct sockaddr_in6 addrIn6;
             struct sockaddr_in addrIn;
+            struct sockaddr_un addrUn;
             struct sockaddr addr;
       } SocketAddress;
 
-      Socket::Socket(SockType const type, const int fd) : type(type), fd(fd) {
-            assert(fd > 0, "Unitialized fd");
-            makeNonBlocking();
+      static void toInetDest(struct in6_addr const& from, InetDest& to) {
+            std::array<uint8_t, IP_ADDRESS_BIT_LEN / NUM_BITS_PER_SIZE_T> fromNetOrder;
+            ::memcpy(&fromNetOrder, &from, sizeof(fromNetOrder));
+            to.addr.set(fromNetOrder);
+      }
+
+      static socklen_t toSocketAddress(InetDest const& dest, SocketAddress& addr) {
+            if (dest.path.size() > 0) {
+                  addr.addrUn = {};
+                  addr.addrUn.sun_family = AF_UNIX;
+                  if (dest.path.size() > sizeof(addr.addrUn.sun_path) - 1) {
+                        throw std::runtime_error("Unix socket path too long: " + dest.path);
+                  }
+                  ::memcpy(addr.addrUn.sun_path, dest.path.data(), dest.path.size());
+                  if (dest.path[0] == '@') {
+                        addr.addrUn.sun_path[0] = '\0';
+                        return offsetof(struct sockaddr_un, sun_path) + dest.path.size();
+                  }
+                  return offsetof(struct sockaddr_un, sun_path) + dest.path.size() + 1;
+            }
+            addr.addrIn6 = {};
+            addr.addrIn6.sin6_family = AF_INET6;
+            addr.addrIn6.sin6_port = networkEndian(dest.port);
+            auto destAddrNet = dest.addr.get();
+            ::memcpy(&addr.addrIn6.sin6_addr, &destAddrNet, sizeof addr.addrIn6.sin6_addr);
+            return sizeof addr.addrIn6;
+      }
+
+      static void fromSocketAddress(SocketAddress const& addr, socklen_t const len, InetDest& to) {
+            to.ifIndex = 0;
+            if (addr.addr.sa_family == AF_UNIX) {
+                  auto const pathLen = len > offsetof(struct sockaddr_un, sun_path) ? len - offsetof(struct sockaddr_un, sun_path) : 0;
+                  if (pathLen == 0) {
+                        to.path.clear();
+                  } else if (addr.addrUn.sun_path[0] == '\0') {
+                        to.path = "@" + std::string(addr.addrUn.sun_path + 1, pathLen - 1);
+                  } else {
+                        to.path = std::string(addr.addrUn.sun_path, ::strnlen(addr.addrUn.sun_path, pathLen));
+                  }
+                  to.valid = to.path.size() > 0;
+            } else if (addr.addr.sa_family == AF_INET6) {
+                  toInetDest(addr.addrIn6.sin6_addr, to);
+                  to.port = networkEndian(addr.addrIn6.sin6_port);
+                  to.path.clear();
+                  to.valid = true;
+            } else {
+                  to.valid = false;
+            }
+      }
+
+      Socket::Socket(SockType const type, const int fd) : type(type), fd(fd >= 0 ? fd : createSocket(type)) {
+            assert(this->fd > 0, "Unitialized fd");
       }
 
       Socket::Socket(SockType const type) : type(type), fd(createSocket(type)) {
             assert(fd > 0, "Unitialized fd");
-            makeNonBlocking();
       }
 
       Socket::~Socket() {
@@ -32,6 +88,10 @@ namespace Sb {
             return false;
       }
 
+      bool Socket::waitingInEvent() {
+            return true;
+      }
+
       void Socket::handleRead() {
             assert(false, "Socket::handleRead()");
       }
@@ -44,6 +104,26 @@ namespace Sb {
             assert(false, "Socket::handleError()");
       }
 
+      bool Socket::handleErrorQueue() {
+            return false;
+      }
+
+      bool Socket::handlePeerClosed() {
+            return false;
+      }
+
+      bool Socket::startDrain() {
+            return false;
+      }
+
+      std::size_t Socket::pendingBytes() {
+            return 0;
+      }
+
+      HandlerKind Socket::handlerKind() const {
+            return HandlerKind::Other;
+      }
+
       void Socket::makeNonBlocking() const {
             auto flags = ::fcntl(fd, F_GETFL, 0);
             pErrorThrow(flags, fd);
@@ -52,26 +132,104 @@ namespace Sb {
       }
 
       int Socket::createSocket(Socket::SockType const type) {
-            int fd = ::socket(AF_INET6, type == UDP ? SOCK_DGRAM : SOCK_STREAM | SOCK_NONBLOCK, 0);
+            int const family = (type == UNIX_STREAM || type == UNIX_DGRAM) ? AF_UNIX : AF_INET6;
+            int const sockType = (type == UDP || type == UNIX_DGRAM) ? SOCK_DGRAM : SOCK_STREAM;
+            int fd = ::socket(family, sockType | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
             pErrorThrow(fd, fd);
             int on = 1;
             switch (type) {
                   case TCP:
-                        pErrorLog(::setsockopt(fd, SOL_TCP, TCP_NODELAY, &on, sizeof(on)), fd);
+                        pErrorLog(::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)), fd);
                         break;
                   case UDP:
                         pErrorLog(::setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)), fd);
-                        pErrorLog(::setsockopt(fd, SOL_TCP, SO_ORIGINAL_DST, &on, sizeof(on)), fd);
+                        break;
+                  case UNIX_STREAM:
+                  case UNIX_DGRAM:
                         break;
             }
             return fd;
       }
 
+      Socket::SockType Socket::typeOf(int const fd) {
+            int family = AF_INET6;
+            int sockType = SOCK_STREAM;
+            socklen_t len = sizeof(family);
+            pErrorLog(::getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &family, &len), fd);
+            len = sizeof(sockType);
+            pErrorLog(::getsockopt(fd, SOL_SOCKET, SO_TYPE, &sockType, &len), fd);
+            if (family == AF_UNIX) {
+                  return sockType == SOCK_DGRAM ? UNIX_DGRAM : UNIX_STREAM;
+            }
+            return sockType == SOCK_DGRAM ? UDP : TCP;
+      }
+
       void Socket::reuseAddress() const {
             const int yes = 1;
             pErrorThrow(::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes), fd);
       }
 
+      void Socket::reusePort() const {
+            int const on = 1;
+            pErrorThrow(::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)), fd);
+      }
+
+      void Socket::deferAccept(Seconds const timeout) const {
+            int const secs = timeout.count();
+            pErrorLog(::setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)), fd);
+      }
+
+      void Socket::fastOpen(int const queueLen) const {
+            pErrorLog(::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queueLen, sizeof(queueLen)), fd);
+      }
+
+      void Socket::fastOpenConnect() const {
+            if (type != TCP) {
+                  return;
+            }
+            int const on = 1;
+            pErrorLog(::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)), fd);
+      }
+
+      bool Socket::setMaxPacingRate(uint64_t const bytesPerSecond) const {
+            if (type != TCP) {
+                  return false;
+            }
+            if (::setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &bytesPerSecond, sizeof(bytesPerSecond)) == 0) {
+                  return true;
+            }
+            uint32_t const narrowRate = bytesPerSecond >= ~0U ? ~0U : static_cast<uint32_t>(bytesPerSecond);
+            auto const ret = ::setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &narrowRate, sizeof(narrowRate));
+            pErrorLog(ret, fd);
+            return ret == 0;
+      }
+
+      void Socket::setCork(bool const on) const {
+            if (type != TCP) {
+                  return;
+            }
+            int const value = on ? 1 : 0;
+            pErrorLog(::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)), fd);
+      }
+
+      void Socket::pushPending() const {
+            if (type != TCP) {
+                  return;
+            }
+            int const on = 1;
+            pErrorLog(::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)), fd);
+      }
+
+      uint32_t Socket::segmentsSent() const {
+            if (type != TCP) {
+                  return 0;
+            }
+            struct tcp_info info{};
+            socklen_t len = sizeof(info);
+            pErrorLog(::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len), fd);
+            return len >= offsetof(struct tcp_info, tcpi_segs_out) + sizeof(info.tcpi_segs_out) ? info.tcpi_segs_out : 0;
+      }
+
       ssize_t Socket::convertFromStdError(ssize_t const error) const {
             if (error >= 0) {
                   return error;
@@ -91,20 +249,83 @@ namespace Sb {
             return convertFromStdError(numRead);
       }
 
-      ssize_t Socket::write(Bytes const& data) const {
+      ssize_t Socket::write(Bytes const& data, bool const more) const {
+            if (more) {
+                  return convertFromStdError(::send(fd, &data[0], data.size(), MSG_MORE));
+            }
             return convertFromStdError(::write(fd, &data[0], data.size()));
       }
 
-      void Socket::listen() const {
-            pErrorThrow(::listen(fd, LISTEN_MAX_PENDING), fd);
+      ssize_t Socket::sendFile(int const fileFd, off_t& offset, std::size_t const length) const {
+            return convertFromStdError(::sendfile(fd, fileFd, &offset, length));
       }
 
-      int Socket::accept() const {
+      bool Socket::enableZeroCopy() const {
+            if (type != TCP && type != UDP) {
+                  return false;
+            }
+            int const on = 1;
+            auto const ret = ::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+            pErrorLog(ret, fd);
+            return ret == 0;
+      }
+
+      ssize_t Socket::writeZeroCopy(Bytes const& data, bool& zeroCopied, bool const more) const {
+            auto const ret = ::send(fd, &data[0], data.size(), MSG_ZEROCOPY | (more ? MSG_MORE : 0));
+            zeroCopied = ret >= 0;
+            if (ret == -1 && errno == ENOBUFS) {
+                  return write(data, more);
+            }
+            return convertFromStdError(ret);
+      }
+
+      bool Socket::zeroCopyCompleted(uint32_t& first, uint32_t& last) const {
+            uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err)) + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+            struct msghdr msg{nullptr, 0, nullptr, 0, &control[0], sizeof(control), 0};
+            for (; ;) {
+                  auto const ret = ::recvmsg(fd, &msg, MSG_ERRQUEUE);
+                  if (ret == -1 && errno == EINTR) {
+                        continue;
+                  } else if (ret < 0) {
+                        return false;
+                  }
+                  break;
+            }
+            for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                  if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                        auto const& err = *reinterpret_cast<struct sock_extended_err const*>(CMSG_DATA(cmsg));
+                        if (err.ee_errno == 0 && err.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                              first = err.ee_info;
+                              last = err.ee_data;
+                              return true;
+                        }
+                  }
+            }
+            return false;
+      }
+
+      void Socket::listen(int const backlog) const {
+            pErrorThrow(::listen(fd, backlog), fd);
+      }
+
+      bool Socket::isListening() const {
+            int on = 0;
+            socklen_t len = sizeof(on);
+            return ::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0 && on != 0;
+      }
+
+      void Socket::shutdownWrite() const {
+            pErrorLog(::shutdown(fd, SHUT_WR), fd);
+      }
+
+      int Socket::accept(InetDest& peer) const {
             SocketAddress addr;
-            socklen_t addrLen = sizeof addr.addrIn6;
-            int aFd = ::accept(fd, &addr.addr, &addrLen);
-            assert(addrLen == sizeof addr.addrIn6, "Buggy address len");
-            return convertFromStdError(aFd);
+            socklen_t addrLen = sizeof(addr);
+            auto const connFd = convertFromStdError(::accept4(fd, &addr.addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC));
+            if(connFd >= 0) {
+                  fromSocketAddress(addr, addrLen, peer);
+            }
+            return connFd;
       }
 
       int Socket::receiveDatagram(InetDest& whereFrom, Bytes& data) const {
@@ -136,6 +357,41 @@ namespace Sb {
             whereFrom.port = networkEndian(addr.addrIn6.sin6_port);
             return numReceived;
       }
+      int Socket::receiveDatagrams(std::vector<Datagram>& batch) const {
+            constexpr std::size_t controlLen = CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(int));
+            struct mmsghdr msgs[MAX_DATAGRAM_BATCH];
+            struct iovec iovecs[MAX_DATAGRAM_BATCH];
+            SocketAddress addrs[MAX_DATAGRAM_BATCH];
+            uint8_t controls[MAX_DATAGRAM_BATCH][controlLen];
+            auto const num = std::min(batch.size(), MAX_DATAGRAM_BATCH);
+            for (std::size_t i = 0; i < num; ++i) {
+                  iovecs[i] = {&batch[i].data[0], batch[i].data.size()};
+                  msgs[i].msg_hdr = {&addrs[i], sizeof(addrs[i]), &iovecs[i], 1, &controls[i][0], controlLen, 0};
+                  msgs[i].msg_len = 0;
+            }
+            auto const numReceived = ::recvmmsg(fd, &msgs[0], num, 0, nullptr);
+            for (int i = 0; i < numReceived; ++i) {
+                  auto& dgram = batch[i];
+                  dgram.data.resize(msgs[i].msg_len);
+                  fromSocketAddress(addrs[i], msgs[i].msg_hdr.msg_namelen, dgram.peer);
+                  dgram.local.valid = false;
+                  dgram.segmentSize = 0;
+                  for (auto cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                              int segmentSize;
+                              ::memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+                              dgram.segmentSize = segmentSize;
+                        } else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+                              auto const& pktInfo = *reinterpret_cast<struct in6_pktinfo*>(CMSG_DATA(cmsg));
+                              toInetDest(pktInfo.ipi6_addr, dgram.local);
+                              dgram.local.ifIndex = pktInfo.ipi6_ifindex;
+                              dgram.local.valid = true;
+                              dgram.peer.ifIndex = pktInfo.ipi6_ifindex;
+                        }
+                  }
+            }
+            return convertFromStdError(numReceived);
+      }
       //            socklen_t addrLen = sizeof(addr.addrIn6);
       //            const auto numReceived = ::recvfrom(fd, &data[0], data.size(), 0, &addr.addr, &addrLen);
       //            pErrorLog(numReceived, fd);
@@ -162,8 +418,52 @@ namespace Sb {
             return numSent;
       }
 
+      int Socket::sendDatagrams(std::deque<Datagram> const& queue, std::size_t const maxCount) const {
+            constexpr std::size_t controlLen = CMSG_SPACE(sizeof(uint16_t));
+            struct mmsghdr msgs[MAX_DATAGRAM_BATCH];
+            struct iovec iovecs[MAX_DATAGRAM_BATCH];
+            SocketAddress addrs[MAX_DATAGRAM_BATCH];
+            uint8_t controls[MAX_DATAGRAM_BATCH][controlLen];
+            auto const num = std::min({queue.size(), maxCount, MAX_DATAGRAM_BATCH});
+            for (std::size_t i = 0; i < num; ++i) {
+                  auto const& dgram = queue[i];
+                  auto const addrLen = dgram.peer.valid ? toSocketAddress(dgram.peer, addrs[i]) : 0;
+                  iovecs[i] = {const_cast<uint8_t*>(dgram.data.data()), dgram.data.size()};
+                  msgs[i].msg_hdr = {addrLen > 0 ? &addrs[i] : nullptr, addrLen, &iovecs[i], 1, nullptr, 0, 0};
+                  msgs[i].msg_len = 0;
+                  if (dgram.segmentSize != 0 && dgram.data.size() > dgram.segmentSize) {
+                        msgs[i].msg_hdr.msg_control = &controls[i][0];
+                        msgs[i].msg_hdr.msg_controllen = controlLen;
+                        auto const cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+                        cmsg->cmsg_level = SOL_UDP;
+                        cmsg->cmsg_type = UDP_SEGMENT;
+                        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                        ::memcpy(CMSG_DATA(cmsg), &dgram.segmentSize, sizeof(uint16_t));
+                  }
+            }
+            return convertFromStdError(::sendmmsg(fd, &msgs[0], num, 0));
+      }
+
+      bool Socket::supportsGso() const {
+            if (type != UDP) {
+                  return false;
+            }
+            int segmentSize = 0;
+            socklen_t len = sizeof(segmentSize);
+            return ::getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, &len) == 0;
+      }
+
+      bool Socket::setGro(bool const on) const {
+            if (type != UDP) {
+                  return false;
+            }
+            int const value = on ? 1 : 0;
+            auto const ret = ::setsockopt(fd, SOL_UDP, UDP_GRO, &value, sizeof(value));
+            pErrorLog(ret, fd);
+            return ret == 0;
+      }
+
       void Socket::bind(uint16_t const port) const {
-            makeNonBlocking();
             SocketAddress addr;
             addr.addrIn6.sin6_family = AF_INET6;
             addr.addrIn6.sin6_port = networkEndian(port);
@@ -171,14 +471,33 @@ namespace Sb {
             pErrorThrow(::bind(fd, &addr.addr, sizeof addr.addrIn6), fd);
       }
 
+      void Socket::bind(std::string const& path) const {
+            SocketAddress addr;
+            auto const addrLen = toSocketAddress(InetDest::unixPath(path), addr);
+            if (path[0] != '@') {
+                  ::unlink(path.c_str());
+            }
+            pErrorThrow(::bind(fd, &addr.addr, addrLen), fd);
+      }
+
+      void Socket::bind(InetDest const& local) const {
+            if(!local.valid) {
+                  throw std::runtime_error("Socket::bind invalid address");
+            }
+            SocketAddress addr;
+            auto const addrLen = toSocketAddress(local, addr);
+            pErrorThrow(::bind(fd, &addr.addr, addrLen), fd);
+      }
+
+      void Socket::bindAnonymous() const {
+            sa_family_t const family = AF_UNIX;
+            pErrorLog(::bind(fd, reinterpret_cast<struct sockaddr const*>(&family), sizeof(family)), fd);
+      }
+
       int Socket::connect(InetDest const& whereTo) const {
-            makeNonBlocking();
             SocketAddress addr;
-            addr.addrIn6.sin6_family = AF_INET6;
-            addr.addrIn6.sin6_port = networkEndian(whereTo.port);
-            auto destAddrNet = whereTo.addr.get();
-            ::memcpy(&addr.addrIn6.sin6_addr, &destAddrNet, sizeof addr.addrIn6.sin6_addr);
-            return convertFromStdError(::connect(fd, &addr.addr, sizeof addr.addrIn6));
+            auto const addrLen = toSocketAddress(whereTo, addr);
+            return convertFromStdError(::connect(fd, &addr.addr, addrLen));
       }
 
       int Socket::getLastError() const {
@@ -188,6 +507,19 @@ namespace Sb {
             return ret;
       }
 
+      int Socket::pendingError() const {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            pErrorLog(::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len), fd);
+            return error;
+      }
+
+      std::size_t Socket::unreadBytes() const {
+            int bytes = 0;
+            pErrorLog(::ioctl(fd, FIONREAD, &bytes), fd);
+            return bytes > 0 ? bytes : 0;
+      }
+
       InetDest Socket::destFromString(const std::string& where, const uint16_t port) {
             InetDest dest;
             dest.port = port;
@@ -204,14 +536,27 @@ namespace Sb {
       }
 
       void Socket::makeTransparent() const {
+            if (type != TCP && type != UDP) {
+                  return;
+            }
             int const on = 1;
             pErrorLog(setsockopt(fd, SOL_IP, IP_TRANSPARENT, &on, sizeof(on)), fd);
       }
 
       InetDest Socket::originalDestination() const {
-            assert(type == TCP, "Only valid for TCP");
             InetDest from;
             SocketAddress addr;
+            if (type == UNIX_STREAM) {
+                  socklen_t addrLen = sizeof(addr);
+                  from.valid = false;
+                  auto const ret = ::getsockname(fd, &addr.addr, &addrLen);
+                  pErrorLog(ret, fd);
+                  if (ret == 0) {
+                        fromSocketAddress(addr, addrLen, from);
+                  }
+                  return from;
+            }
+            assert(type == TCP, "Only valid for TCP");
 
             socklen_t addrLen = sizeof(addr.addr);
             auto ret = ::getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &addr.addr, &addrLen);
@@ -1,16 +1,28 @@
 ﻿#pragma once
 #include <atomic>
+#include <deque>
+#include <vector>
 #include "event.hpp"
 #include "types.hpp"
 #include "utils.hpp"
 
 namespace Sb {
+      constexpr uint64_t UNLIMITED_PACING_RATE = ~0ULL;
+
+      class Datagram final {
+      public:
+            InetDest peer;
+            InetDest local;
+            Bytes data;
+            uint16_t segmentSize;
+      };
+
       class Socket : virtual public Runnable {
       public:
             static InetDest destFromString(const std::string&where, const uint16_t port);
       protected:
             enum SockType {
-                  UDP = 1, TCP = 2
+                  UDP = 1, TCP = 2, UNIX_STREAM = 3, UNIX_DGRAM = 4
             };
 
             explicit Socket(SockType const type);
@@ -21,24 +33,56 @@ namespace Sb {
             void onReadComplete();
             void onWriteComplete();
             void reuseAddress() const;
+            void reusePort() const;
+            void deferAccept(Seconds const timeout) const;
+            void fastOpen(int const queueLen) const;
+            void fastOpenConnect() const;
+            void setCork(bool const on) const;
+            bool setMaxPacingRate(uint64_t const bytesPerSecond) const;
+            void pushPending() const;
+            uint32_t segmentsSent() const;
             ssize_t read(Bytes& data) const;
-            ssize_t write(Bytes const& data) const;
+            ssize_t write(Bytes const& data, bool const more = false) const;
+            ssize_t sendFile(int const fileFd, off_t& offset, std::size_t const length) const;
+            bool enableZeroCopy() const;
+            ssize_t writeZeroCopy(Bytes const& data, bool& zeroCopied, bool const more = false) const;
+            bool zeroCopyCompleted(uint32_t& first, uint32_t& last) const;
             void bind(uint16_t const port) const;
+            void bind(std::string const& path) const;
+            void bind(InetDest const& local) const;
+            void bindAnonymous() const;
             int connect(InetDest const& whereTo) const;
-            void listen() const;
-            int accept() const;
+            void listen(int const backlog) const;
+            void shutdownWrite() const;
+            int accept(InetDest& peer) const;
             InetDest originalDestination() const;
             int receiveDatagram(InetDest& whereFrom, Bytes& data) const;
+            int receiveDatagrams(std::vector<Datagram>& batch) const;
             int sendDatagram(InetDest const& whereTo, Bytes const& data) const;
+            int sendDatagrams(std::deque<Datagram> const& queue, std::size_t const maxCount = MAX_DATAGRAM_BATCH) const;
+            bool supportsGso() const;
+            bool setGro(bool const on) const;
             int getLastError() const;
+            int pendingError() const;
+            std::size_t unreadBytes() const;
+            bool isListening() const;
+            static SockType typeOf(int const fd);
       protected:
             virtual void handleError();
+            virtual bool handleErrorQueue();
+            virtual bool handlePeerClosed();
             virtual void handleRead();
             virtual void handleWrite();
             virtual bool waitingOutEvent();
+            virtual bool waitingInEvent();
+            // Returns true when the engine should wait for this socket to close before a drain completes.
+            virtual bool startDrain();
+            virtual std::size_t pendingBytes();
+            virtual HandlerKind handlerKind() const;
       private:
             static int createSocket(SockType const type);
             friend class Engine;
+            friend class Handover;
 
             ssize_t convertFromStdError(ssize_t const error) const;
       protected:
@@ -46,7 +90,8 @@ namespace Sb {
             SockType const type;
             uint64_t evId;
             int const fd;
-      private:
-            const int LISTEN_MAX_PENDING = 64;
+            bool draining = false;
+            // The run-queue class for this socket's events, set by Engine::add.
+            std::atomic<Priority> priority{Priority::Normal};
       };
 }
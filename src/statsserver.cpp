@@ -0,0 +1,248 @@
+﻿#include <iomanip>
+#include <sstream>
+#include "statsserver.hpp"
+#include "engine.hpp"
+#include "counters.hpp"
+#include "tcplistener.hpp"
+
+namespace Sb {
+      constexpr std::size_t MAX_STATS_REQUEST = 8192;
+      static char const* const PRIORITY_NAMES[NUM_PRIORITIES] = {"control", "normal", "bulk"};
+      static double const QUANTILES[] = {0.5, 0.9, 0.99};
+
+      class StatsServer::Snapshot final {
+      public:
+            EngineLoad load;
+            EngineLatency latency;
+            ResolverStats resolver;
+            std::vector<AdmissionStats> admission;
+            std::vector<TrafficSnapshot> traffic;
+            uint64_t bytesReceived = 0;
+            uint64_t bytesSent = 0;
+            bool draining = false;
+      };
+
+      class StatsServer::HttpSession final : public TcpStreamIf {
+      public:
+            virtual void received(Bytes const& data) override {
+                  std::lock_guard<std::mutex> sync(lock);
+                  if(answered) {
+                        return;
+                  }
+                  request.append(data.begin(), data.end());
+                  if(request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+                        if(request.size() > MAX_STATS_REQUEST) {
+                              reply("400 Bad Request", "text/plain", "request too large\n");
+                        }
+                        return;
+                  }
+                  std::istringstream line(request.substr(0, request.find_first_of("\r\n")));
+                  std::string method;
+                  std::string path;
+                  line >> method >> path;
+                  if(method != "GET") {
+                        reply("405 Method Not Allowed", "text/plain", "only GET is served\n");
+                  } else if(path == "/metrics") {
+                        reply("200 OK", "text/plain; version=0.0.4", render(Format::Prometheus));
+                  } else if(path == "/stats") {
+                        reply("200 OK", "application/json", render(Format::Json));
+                  } else {
+                        reply("404 Not Found", "text/plain", "try /metrics or /stats\n");
+                  }
+            }
+
+            virtual void writeComplete() override {
+                  // Keep answering while bulk transfers saturate the workers.
+                  std::lock_guard<std::mutex> sync(lock);
+                  auto ref = tcpStream.lock();
+                  if(ref && !prioritySet) {
+                        prioritySet = true;
+                        ref->setPriority(Priority::Control);
+                  }
+            }
+
+            virtual void disconnected() override {
+            }
+      private:
+            void reply(std::string const& status, std::string const& contentType, std::string const& body) {
+                  answered = true;
+                  auto ref = tcpStream.lock();
+                  if(!ref) {
+                        return;
+                  }
+                  auto const response = "HTTP/1.1 " + status + "\r\nContent-Type: " + contentType + "\r\nContent-Length: " + std::to_string(body.size()) +
+                                        "\r\nConnection: close\r\n\r\n" + body;
+                  ref->queueWrite(Bytes(response.begin(), response.end()));
+                  ref->shutdownWrite();
+            }
+      private:
+            std::mutex lock;
+            std::string request;
+            bool answered = false;
+            bool prioritySet = false;
+      };
+
+      void StatsServer::create(uint16_t const port, std::string const& address) {
+            ListenerOptions options;
+            options.address = address;
+            TcpListener::create(port, []() {
+                  return std::make_shared<HttpSession>();
+            }, options);
+      }
+
+      // Listener names may hold a Unix path; both formats escape quotes and backslashes the same way.
+      static std::string quoted(std::string const& text) {
+            std::string out = "\"";
+            for(auto const c : text) {
+                  if(c == '"' || c == '\\') {
+                        out += '\\';
+                  }
+                  out += c;
+            }
+            return out + "\"";
+      }
+
+      std::string StatsServer::render(Format const format) {
+            auto const snap = collect();
+            return format == Format::Json ? toJson(snap) : toPrometheus(snap);
+      }
+
+      StatsServer::Snapshot StatsServer::collect() {
+            Snapshot snap;
+            snap.load = Engine::load();
+            snap.latency = Engine::latency();
+            snap.resolver = Engine::resolver().stats();
+            snap.admission = TcpListener::admissionStats();
+            snap.bytesReceived = Counters::totalIngress();
+            snap.bytesSent = Counters::totalEgress();
+            snap.traffic = TrafficTotals::registry();
+            snap.draining = Engine::isDraining();
+            return snap;
+      }
+
+      std::string StatsServer::toPrometheus(Snapshot const& snap) {
+            std::ostringstream out;
+            out << std::setprecision(9);
+            auto const family = [&out](std::string const& name, std::string const& type, std::string const& help) {
+                  out << "# HELP sblade_" << name << " " << help << "\n# TYPE sblade_" << name << " " << type << "\n";
+            };
+            auto const summary = [&out](std::string const& name, std::string const& labels, HistogramSnapshot const& hist, double const scale) {
+                  auto const prefix = labels.empty() ? std::string("{") : "{" + labels + ",";
+                  for(auto const q : QUANTILES) {
+                        out << "sblade_" << name << prefix << "quantile=\"" << q << "\"} " << hist.percentile(q) * scale << "\n";
+                  }
+                  auto const suffix = labels.empty() ? std::string() : "{" + labels + "}";
+                  out << "sblade_" << name << "_sum" << suffix << " " << hist.sum * scale << "\n";
+                  out << "sblade_" << name << "_count" << suffix << " " << hist.count << "\n";
+            };
+            double const nsToSecs = 1.0 / ONE_SEC_IN_NS;
+
+            family("connections", "gauge", "Sockets registered with the engine.");
+            out << "sblade_connections " << snap.load.connections << "\n";
+            family("received_bytes_total", "counter", "Bytes read by all streams.");
+            out << "sblade_received_bytes_total " << snap.bytesReceived << "\n";
+            family("sent_bytes_total", "counter", "Bytes written by all streams.");
+            out << "sblade_sent_bytes_total " << snap.bytesSent << "\n";
+            family("queue_depth", "gauge", "Events waiting for a worker, by priority class.");
+            for(std::size_t i = 0; i < NUM_PRIORITIES; ++i) {
+                  out << "sblade_queue_depth{class=\"" << PRIORITY_NAMES[i] << "\"} " << snap.load.queueDepths[i] << "\n";
+            }
+            family("queue_oldest_wait_seconds", "gauge", "How long the oldest queued event has waited.");
+            out << "sblade_queue_oldest_wait_seconds " << snap.load.queueWait.count() * nsToSecs << "\n";
+            family("timers", "gauge", "Armed timers.");
+            out << "sblade_timers " << snap.load.timers << "\n";
+            family("resolver_cache_hits_total", "counter", "Lookups answered from the resolver cache.");
+            out << "sblade_resolver_cache_hits_total " << snap.resolver.hits << "\n";
+            family("resolver_cache_misses_total", "counter", "Lookups sent to a name server.");
+            out << "sblade_resolver_cache_misses_total " << snap.resolver.misses << "\n";
+            family("resolver_cache_hit_ratio", "gauge", "Share of lookups answered from the cache.");
+            out << "sblade_resolver_cache_hit_ratio " << snap.resolver.hitRate() << "\n";
+            family("resolver_cached_names", "gauge", "Names held in the resolver cache.");
+            out << "sblade_resolver_cached_names " << snap.resolver.cachedNames << "\n";
+            family("accepted_total", "counter", "Connections admitted per listener.");
+            for(auto const& listener : snap.admission) {
+                  out << "sblade_accepted_total{listener=" << quoted(listener.listener) << "} " << listener.accepted << "\n";
+            }
+            family("shed_total", "counter", "Connections closed by admission control per listener.");
+            for(auto const& listener : snap.admission) {
+                  out << "sblade_shed_total{listener=" << quoted(listener.listener) << "} " << listener.shed << "\n";
+            }
+            family("accept_pauses_total", "counter", "Times each listener paused accepting.");
+            for(auto const& listener : snap.admission) {
+                  out << "sblade_accept_pauses_total{listener=" << quoted(listener.listener) << "} " << listener.pauses << "\n";
+            }
+            family("draining", "gauge", "1 while the engine drains.");
+            out << "sblade_draining " << (snap.draining ? 1 : 0) << "\n";
+            family("traffic_received_bytes_total", "counter", "Bytes read per listener, and per client when client is set.");
+            for(auto const& group : snap.traffic) {
+                  out << "sblade_traffic_received_bytes_total{listener=" << quoted(group.listener) << ",client=" << quoted(group.client) << "} " << group.ingress << "\n";
+            }
+            family("traffic_sent_bytes_total", "counter", "Bytes written per listener, and per client when client is set.");
+            for(auto const& group : snap.traffic) {
+                  out << "sblade_traffic_sent_bytes_total{listener=" << quoted(group.listener) << ",client=" << quoted(group.client) << "} " << group.egress << "\n";
+            }
+
+            family("queue_wait_seconds", "summary", "Time from enqueue to a worker starting the event.");
+            summary("queue_wait_seconds", "", snap.latency.queueWait, nsToSecs);
+            family("handler_run_seconds", "summary", "Event handler run time by handler kind.");
+            for(std::size_t i = 0; i < NUM_HANDLER_KINDS; ++i) {
+                  summary("handler_run_seconds", "kind=\"" + handlerKindName(static_cast<HandlerKind>(i)) + "\"", snap.latency.handlerRun[i], nsToSecs);
+            }
+            family("epoll_batch_size", "summary", "Events returned by one epoll_wait.");
+            summary("epoll_batch_size", "", snap.latency.epollBatch, 1.0);
+            family("timer_lag_seconds", "summary", "How late timers fire.");
+            summary("timer_lag_seconds", "", snap.latency.timerLag, nsToSecs);
+            return out.str();
+      }
+
+      std::string StatsServer::toJson(Snapshot const& snap) {
+            std::ostringstream out;
+            out << std::setprecision(9);
+            auto const summary = [&out](HistogramSnapshot const& hist) {
+                  out << "{\"count\":" << hist.count << ",\"mean\":" << hist.mean();
+                  for(auto const q : QUANTILES) {
+                        out << ",\"p" << q * 100 << "\":" << hist.percentile(q);
+                  }
+                  out << ",\"max\":" << hist.max << "}";
+            };
+
+            out << "{\"connections\":" << snap.load.connections;
+            out << ",\"bytesReceived\":" << snap.bytesReceived << ",\"bytesSent\":" << snap.bytesSent;
+            out << ",\"queueDepth\":{";
+            for(std::size_t i = 0; i < NUM_PRIORITIES; ++i) {
+                  out << (i == 0 ? "" : ",") << "\"" << PRIORITY_NAMES[i] << "\":" << snap.load.queueDepths[i];
+            }
+            out << "},\"queueOldestWaitNs\":" << snap.load.queueWait.count();
+            out << ",\"timers\":" << snap.load.timers;
+            out << ",\"resolver\":{\"hits\":" << snap.resolver.hits << ",\"misses\":" << snap.resolver.misses << ",\"hitRate\":" << snap.resolver.hitRate()
+                << ",\"cachedNames\":" << snap.resolver.cachedNames << "}";
+            out << ",\"admission\":[";
+            for(std::size_t i = 0; i < snap.admission.size(); ++i) {
+                  auto const& listener = snap.admission[i];
+                  out << (i == 0 ? "" : ",") << "{\"listener\":" << quoted(listener.listener) << ",\"accepted\":" << listener.accepted << ",\"shed\":"
+                      << listener.shed << ",\"pauses\":" << listener.pauses << "}";
+            }
+            out << "]";
+            out << ",\"draining\":" << (snap.draining ? "true" : "false");
+            out << ",\"traffic\":[";
+            for(std::size_t i = 0; i < snap.traffic.size(); ++i) {
+                  auto const& group = snap.traffic[i];
+                  out << (i == 0 ? "" : ",") << "{\"listener\":" << quoted(group.listener) << ",\"client\":" << quoted(group.client) << ",\"received\":"
+                      << group.ingress << ",\"sent\":" << group.egress << "}";
+            }
+            out << "]";
+            out << ",\"latency\":{\"queueWaitNs\":";
+            summary(snap.latency.queueWait);
+            out << ",\"handlerRunNs\":{";
+            for(std::size_t i = 0; i < NUM_HANDLER_KINDS; ++i) {
+                  out << (i == 0 ? "" : ",") << "\"" << handlerKindName(static_cast<HandlerKind>(i)) << "\":";
+                  summary(snap.latency.handlerRun[i]);
+            }
+            out << "},\"epollBatch\":";
+            summary(snap.latency.epollBatch);
+            out << ",\"timerLagNs\":";
+            summary(snap.latency.timerLag);
+            out << "}}\n";
+            return out.str();
+      }
+}
@@ -0,0 +1,24 @@
+﻿#pragma once
+#include <cstdint>
+#include <string>
+
+namespace Sb {
+      // Serves a snapshot of the engine's counters over HTTP ("GET /metrics" for the Prometheus text
+      // format, "GET /stats" for JSON). The snapshot names client addresses, so it binds to loopback
+      // unless told otherwise. Every value is read from atomics or under a short per-subsystem lock.
+      class StatsServer final {
+      public:
+            enum class Format {
+                  Prometheus, Json
+            };
+            static void create(uint16_t const port, std::string const& address = "127.0.0.1");
+            static std::string render(Format const format);
+      private:
+            class Snapshot;
+            class HttpSession;
+
+            static Snapshot collect();
+            static std::string toPrometheus(Snapshot const& snap);
+            static std::string toJson(Snapshot const& snap);
+      };
+}
@@ -1,13 +1,21 @@
-﻿#include "tcpconn.hpp"
+﻿#include <algorithm>
+#include "connpool.hpp"
+#include "tcpconn.hpp"
 
 namespace Sb {
       namespace TcpConnection {
-            void create(std::string const&dest, uint16_t const port, std::shared_ptr<TcpStreamIf> const& client) {
+            void create(InetDest const& dest, std::shared_ptr<TcpStreamIf> const& client, bool const fastOpen) {
+                  if(!ConnectionPool::acquire(dest, client)) {
+                        TcpStream::create(client, dest, fastOpen);
+                  }
+            }
+
+            void create(std::string const&dest, uint16_t const port, std::shared_ptr<TcpStreamIf> const& client, bool const fastOpen) {
                   InetDest inetDest = Socket::destFromString(dest, port);
                   if (inetDest.valid) {
-                        TcpStream::create(client, inetDest);
+                        create(inetDest, client, fastOpen);
                   } else {
-                        auto ref = std::make_shared<TcpConn>(client, port);
+                        auto ref = std::make_shared<TcpConn>(client, dest, port, fastOpen);
                         ref->self = ref;
                         std::shared_ptr<ResolverIf> res = ref;
                         Engine::resolver().resolve(res, dest);
@@ -15,11 +23,71 @@ namespace Sb {
             }
       }
 
-      TcpConn::TcpConn(std::shared_ptr<TcpStreamIf> const& client, uint16_t const port) : client(client), port(port) {
+      // One leg of a happy eyeballs race. Anything the peer sends before the race is decided
+      // is held back, with reading paused, and handed to the real client with the stream.
+      class TcpConn::Attempt final : public TcpStreamIf {
+      public:
+            Attempt(std::weak_ptr<TcpConn> const& conn, InetDest const& dest) : conn(conn), dest(dest) {
+            }
+
+            virtual void received(Bytes const& data) override {
+                  std::lock_guard<std::mutex> sync(lock);
+                  if(target) {
+                        target->received(data);
+                  } else {
+                        auto ref = tcpStream.lock();
+                        if(ref) {
+                              ref->pauseReading();
+                        }
+                        unread.insert(unread.end(), data.begin(), data.end());
+                  }
+            }
+
+            virtual void writeComplete() override {
+                  auto ref = conn.lock();
+                  if(ref) {
+                        ref->attemptConnected(this);
+                  }
+            }
+
+            virtual void disconnected() override {
+                  auto ref = conn.lock();
+                  if(ref) {
+                        ref->attemptFailed(this);
+                  }
+            }
+
+            virtual void peerClosedWrite() override {
+            }
+
+            std::shared_ptr<TcpStream> stream() const {
+                  return tcpStream.lock();
+            }
+
+            Bytes claim(std::shared_ptr<TcpStreamIf> const& client) {
+                  std::lock_guard<std::mutex> sync(lock);
+                  target = client;
+                  return std::move(unread);
+            }
+
+            std::weak_ptr<TcpConn> const conn;
+            InetDest const dest;
+      private:
+            std::mutex lock;
+            std::shared_ptr<TcpStreamIf> target;
+            Bytes unread;
+      };
+
+      std::mutex TcpConn::familyLock;
+      std::unordered_map<std::string, bool> TcpConn::familyByHost;
+
+      TcpConn::TcpConn(std::shared_ptr<TcpStreamIf> const& client, std::string const& host, uint16_t const port, bool const fastOpen)
+                  : client(client), host(host), port(port), fastOpen(fastOpen) {
       }
 
       TcpConn::~TcpConn() {
             Engine::resolver().cancel(this);
+            Engine::cancelTimer(nextAttempt);
             std::lock_guard<std::mutex> sync(lock);
             if (client) {
                   client->disconnected();
@@ -29,15 +97,166 @@ namespace Sb {
       void TcpConn::doConnect(std::shared_ptr<TcpConn> const& ref, InetDest const&dest) {
             std::lock_guard<std::mutex> sync(lock);
             if (client) {
-                  TcpStream::create(client, dest);
+                  TcpConnection::create(dest, client, fastOpen);
                   client = nullptr;
             }
             self = nullptr;
       }
 
       void TcpConn::resolved(IpAddr const&addr) {
-            InetDest dest{addr, true, port};
-            doConnect(self, dest);
+            resolvedAll({addr});
+      }
+
+      void TcpConn::resolvedAll(std::vector<IpAddr> const& addrs) {
+            auto const keepAlive = self;
+            if(addrs.size() == 1) {
+                  doConnect(keepAlive, InetDest{addrs.front(), true, port, 0});
+                  return;
+            }
+            std::deque<InetDest> ipv6;
+            std::deque<InetDest> ipv4;
+            for(auto const& addr : addrs) {
+                  (addr.isIpv4Addr() ? ipv4 : ipv6).push_back(InetDest{addr, true, port, 0});
+            }
+            auto& first = (prefersIpv4() || ipv6.size() == 0) ? ipv4 : ipv6;
+            auto& second = (&first == &ipv4) ? ipv6 : ipv4;
+            std::shared_ptr<Attempt> next;
+            {
+                  std::lock_guard<std::mutex> sync(lock);
+                  if(!client) {
+                        return;
+                  }
+                  while(first.size() > 0 || second.size() > 0) {
+                        for(auto family : {&first, &second}) {
+                              if(family->size() > 0) {
+                                    pending.push_back(family->front());
+                                    family->pop_front();
+                              }
+                        }
+                  }
+                  for(auto const& dest : pending) {
+                        if(ConnectionPool::acquire(dest, client)) {
+                              client = nullptr;
+                              pending.clear();
+                              self = nullptr;
+                              return;
+                        }
+                  }
+                  nextAttempt = Event(shared_from_this(), std::bind(&TcpConn::startNextAttempt, this));
+                  next = takeNextAttempt();
+            }
+            launch(next);
+      }
+
+      std::shared_ptr<TcpConn::Attempt> TcpConn::takeNextAttempt() {
+            if(pending.size() == 0) {
+                  return nullptr;
+            }
+            auto const attempt = std::make_shared<Attempt>(self, pending.front());
+            pending.pop_front();
+            attempts.push_back(attempt);
+            if(pending.size() > 0) {
+                  Engine::setTimer(nextAttempt, CONNECTION_ATTEMPT_DELAY);
+            }
+            return attempt;
+      }
+
+      // Raced attempts never use fast open. With TCP_FASTOPEN_CONNECT, connect() reports success at once
+      // and the SYN waits for the first write, so every leg would look connected before any handshake and
+      // the first one launched would always win. Only a single address (doConnect) honours fastOpen.
+      void TcpConn::launch(std::shared_ptr<Attempt> const& attempt) {
+            if(attempt) {
+                  TcpStream::create(attempt, attempt->dest);
+            }
+      }
+
+      void TcpConn::startNextAttempt() {
+            std::shared_ptr<Attempt> next;
+            {
+                  std::lock_guard<std::mutex> sync(lock);
+                  if(!client) {
+                        return;
+                  }
+                  next = takeNextAttempt();
+            }
+            launch(next);
+      }
+
+      void TcpConn::attemptConnected(Attempt* const attempt) {
+            std::shared_ptr<TcpConn> keepAlive;
+            std::shared_ptr<TcpStream> winner;
+            std::shared_ptr<TcpStreamIf> target;
+            std::vector<std::shared_ptr<TcpStream>> losers;
+            Bytes unread;
+            {
+                  std::lock_guard<std::mutex> sync(lock);
+                  auto const it = std::find_if(attempts.begin(), attempts.end(), [attempt](std::shared_ptr<Attempt> const& what) {
+                        return what.get() == attempt;
+                  });
+                  if(it == attempts.end() || !client) {
+                        return;
+                  }
+                  winner = attempt->stream();
+                  if(!winner || !winner->didConnect()) {
+                        return;
+                  }
+                  for(auto const& other : attempts) {
+                        auto const stream = other->stream();
+                        if(other.get() != attempt && stream) {
+                              losers.push_back(stream);
+                        }
+                  }
+                  keepAlive = std::move(self);
+                  target = std::move(client);
+                  unread = attempt->claim(target);
+                  pending.clear();
+                  attempts.clear();
+                  Engine::cancelTimer(nextAttempt);
+            }
+            recordFamily(attempt->dest.addr.isIpv4Addr());
+            for(auto const& loser : losers) {
+                  loser->disconnect();
+            }
+            winner->rebind(target, unread);
+      }
+
+      void TcpConn::attemptFailed(Attempt* const attempt) {
+            std::shared_ptr<TcpConn> keepAlive;
+            std::shared_ptr<Attempt> next;
+            {
+                  std::lock_guard<std::mutex> sync(lock);
+                  auto const it = std::find_if(attempts.begin(), attempts.end(), [attempt](std::shared_ptr<Attempt> const& what) {
+                        return what.get() == attempt;
+                  });
+                  if(it == attempts.end()) {
+                        return;
+                  }
+                  attempts.erase(it);
+                  if(!client) {
+                        return;
+                  }
+                  Engine::cancelTimer(nextAttempt);
+                  next = takeNextAttempt();
+                  if(!next && attempts.size() == 0) {
+                        logDebug("TcpConn::attemptFailed no address left for " + host);
+                        keepAlive = std::move(self);
+                  }
+            }
+            launch(next);
+      }
+
+      bool TcpConn::prefersIpv4() const {
+            std::lock_guard<std::mutex> sync(familyLock);
+            auto const it = familyByHost.find(host);
+            return it != familyByHost.end() && it->second;
+      }
+
+      void TcpConn::recordFamily(bool const ipv4) const {
+            std::lock_guard<std::mutex> sync(familyLock);
+            if(familyByHost.size() >= MAX_FAMILY_ENTRIES) {
+                  familyByHost.clear();
+            }
+            familyByHost[host] = ipv4;
       }
 
       void TcpConn::notResolved() {
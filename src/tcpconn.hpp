@@ -1,5 +1,8 @@
 ﻿#pragma once
+#include <deque>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include "engine.hpp"
 #include "socket.hpp"
 #include "types.hpp"
@@ -9,23 +12,43 @@
 namespace Sb {
       class TcpConn;
       namespace TcpConnection {
-            void create(InetDest const& dest, std::shared_ptr<TcpStreamIf> const& client);
-            void create(std::string const& dest, uint16_t const port, std::shared_ptr<TcpStreamIf> const& client);
+            // fastOpen applies when the destination is a single address; a happy eyeballs race connects without it.
+            void create(InetDest const& dest, std::shared_ptr<TcpStreamIf> const& client, bool const fastOpen = false);
+            void create(std::string const& dest, uint16_t const port, std::shared_ptr<TcpStreamIf> const& client, bool const fastOpen = false);
       }
-      class TcpConn final : public ResolverIf {
+      class TcpConn final : public ResolverIf, public Runnable {
       public:
-            friend void TcpConnection::create(std::string const& dest, uint16_t const port, std::shared_ptr<TcpStreamIf> const& client);
-            friend void TcpConnection::create(InetDest const& dest, std::shared_ptr<TcpStreamIf> const& client);
-            TcpConn(std::shared_ptr<TcpStreamIf> const& client, uint16_t const port);
+            friend void TcpConnection::create(std::string const& dest, uint16_t const port, std::shared_ptr<TcpStreamIf> const& client, bool const fastOpen);
+            friend void TcpConnection::create(InetDest const& dest, std::shared_ptr<TcpStreamIf> const& client, bool const fastOpen);
+            TcpConn(std::shared_ptr<TcpStreamIf> const& client, std::string const& host, uint16_t const port, bool const fastOpen);
             virtual ~TcpConn();
             virtual void resolved(IpAddr const& addr) override;
+            virtual void resolvedAll(std::vector<IpAddr> const& addrs) override;
             virtual void notResolved() override;
       private:
+            class Attempt;
+
             virtual void doConnect(std::shared_ptr<TcpConn> const& ref, InetDest const& dest);
+            std::shared_ptr<Attempt> takeNextAttempt();
+            void launch(std::shared_ptr<Attempt> const& attempt);
+            void startNextAttempt();
+            void attemptConnected(Attempt* const attempt);
+            void attemptFailed(Attempt* const attempt);
+            void recordFamily(bool const ipv4) const;
+            bool prefersIpv4() const;
       private:
             std::shared_ptr<TcpStreamIf> client;
+            std::string const host;
             uint16_t port;
+            bool fastOpen;
             std::shared_ptr<TcpConn> self;
             std::mutex lock;
+            std::deque<InetDest> pending;
+            std::vector<std::shared_ptr<Attempt>> attempts;
+            Event nextAttempt;
+            NanoSecs const CONNECTION_ATTEMPT_DELAY = NanoSecs{250 * ONE_MS_IN_NS};
+            std::size_t const MAX_FAMILY_ENTRIES = 4096;
+            static std::mutex familyLock;
+            static std::unordered_map<std::string, bool> familyByHost;
       };
 }
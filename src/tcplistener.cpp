@@ -1,21 +1,93 @@
 ﻿#include <string>
+#include <unistd.h>
 #include "logger.hpp"
 #include "tcplistener.hpp"
+#include "handover.hpp"
 
 namespace Sb {
-      void
-      TcpListener::create(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory) {
-            std::shared_ptr<Socket> ref = std::make_shared<TcpListener>(port, clientFactory);
-            Engine::add(ref);
+      std::mutex TcpListener::registryLock;
+      std::map<std::string, std::weak_ptr<TcpListener>> TcpListener::listeners;
+
+      void TcpListener::create(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory, ListenerOptions const& options) {
+            auto listener = std::make_shared<TcpListener>(port, clientFactory, options);
+            listener->admissionCheck = Event(listener, std::bind(&TcpListener::asyncAdmission, listener.get()));
+            listener->name = "tcp:" + std::to_string(port);
+            listener->traffic = TrafficTotals::get(listener->name);
+            {
+                  std::lock_guard<std::mutex> sync(registryLock);
+                  listeners[listener->name] = listener;
+            }
+            std::shared_ptr<Socket> ref = listener;
+            Engine::add(ref, Priority::Control);
+            Handover::publish(listener->name, ref);
+      }
+
+      void TcpListener::create(std::string const& path, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory, ListenerOptions const& options) {
+            auto listener = std::make_shared<TcpListener>(path, clientFactory, options);
+            listener->admissionCheck = Event(listener, std::bind(&TcpListener::asyncAdmission, listener.get()));
+            listener->name = "unix:" + path;
+            listener->traffic = TrafficTotals::get(listener->name);
+            {
+                  std::lock_guard<std::mutex> sync(registryLock);
+                  listeners[listener->name] = listener;
+            }
+            std::shared_ptr<Socket> ref = listener;
+            Engine::add(ref, Priority::Control);
+            Handover::publish(listener->name, ref);
+      }
+
+      std::vector<AdmissionStats> TcpListener::admissionStats() {
+            std::vector<AdmissionStats> all;
+            std::lock_guard<std::mutex> sync(registryLock);
+            for(auto it = listeners.begin(); it != listeners.end();) {
+                  auto const listener = it->second.lock();
+                  if(!listener) {
+                        it = listeners.erase(it);
+                        continue;
+                  }
+                  AdmissionStats stats;
+                  stats.listener = it->first;
+                  stats.accepted = listener->numAccepted;
+                  stats.shed = listener->numShed;
+                  stats.pauses = listener->numPauses;
+                  all.push_back(stats);
+                  ++it;
+            }
+            return all;
       }
 
-      TcpListener::TcpListener(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory) : Socket(TCP),
-                                                                                                                          clientFactory(clientFactory) {
+      TcpListener::TcpListener(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory, ListenerOptions const& options)
+                  : Socket(TCP, Handover::adopt("tcp:" + std::to_string(port))), clientFactory(clientFactory), options(options) {
+            // An inherited listener is already configured and keeps its backlog.
+            if(isListening()) {
+                  return;
+            }
             reuseAddress();
+            if(options.reusePort) {
+                  reusePort();
+            }
             makeTransparent();
-            bind(port);
-            makeNonBlocking();
-            listen();
+            if(options.address.empty()) {
+                  bind(port);
+            } else {
+                  bind(destFromString(options.address, port));
+            }
+            if(options.deferAccept.count() > 0) {
+                  deferAccept(options.deferAccept);
+            }
+            if(options.fastOpenQueue > 0) {
+                  fastOpen(options.fastOpenQueue);
+            }
+            listen(options.backlog);
+      }
+
+      TcpListener::TcpListener(std::string const& path, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory, ListenerOptions const& options)
+                  : Socket(UNIX_STREAM, Handover::adopt("unix:" + path)), clientFactory(clientFactory), options(options) {
+            if(isListening()) {
+                  return;
+            }
+            bind(path);
+            listen(options.backlog);
       }
 
       TcpListener::~TcpListener() {
@@ -23,21 +95,113 @@ namespace Sb {
 
       void TcpListener::handleRead() {
             for(; ;) {
+                  bool const admitted = admit();
+                  if(!admitted && options.admission.shed == AdmissionLimits::Shed::PauseAccept) {
+                        break;
+                  }
                   int connFd = -1;
+                  InetDest peer{};
                   {
                         std::lock_guard<std::mutex> sync(lock);
-                        connFd = accept();
+                        connFd = accept(peer);
                   }
-                  if(connFd >= 0) {
-                        createStream(connFd);
-                  } else {
+                  if(connFd < 0) {
                         break;
+                  } else if(admitted) {
+                        ++numAccepted;
+                        createStream(connFd, peer);
+                  } else {
+                        ++numShed;
+                        ::close(connFd);
+                  }
+            }
+      }
+
+      bool TcpListener::waitingInEvent() {
+            return !shedding || options.admission.shed != AdmissionLimits::Shed::PauseAccept;
+      }
+
+      bool TcpListener::admit() {
+            if(shedding) {
+                  if(overloaded(options.admission.resumeRatio)) {
+                        return false;
                   }
+                  shedding = false;
+                  logDebug("TcpListener admitting again");
+                  return true;
+            }
+            if(!overloaded(1.0)) {
+                  return true;
+            }
+            if(!shedding.exchange(true)) {
+                  ++numPauses;
+                  logWarn("TcpListener overloaded, shedding connections");
+                  Engine::setTimer(admissionCheck, options.admission.recheckInterval);
             }
+            return false;
       }
 
-      void TcpListener::createStream(const int connFd) {
+      bool TcpListener::overloaded(double const ratio) const {
+            auto const& limits = options.admission;
+            if(limits.maxQueueDepth == 0 && limits.maxQueueWait.count() == 0 && limits.maxConnections == 0) {
+                  return false;
+            }
+            auto const load = Engine::load();
+            return (limits.maxQueueDepth != 0 && load.queueDepth >= limits.maxQueueDepth * ratio) ||
+                   (limits.maxQueueWait.count() != 0 && load.queueWait.count() >= limits.maxQueueWait.count() * ratio) ||
+                   (limits.maxConnections != 0 && load.connections >= limits.maxConnections * ratio);
+      }
+
+      // Paused listeners have no input interest, so only this timer notices that the load has dropped.
+      void TcpListener::asyncAdmission() {
+            if(!shedding) {
+                  return;
+            }
+            if(overloaded(options.admission.resumeRatio)) {
+                  Engine::setTimer(admissionCheck, options.admission.recheckInterval);
+            } else {
+                  shedding = false;
+                  logDebug("TcpListener admitting again");
+                  Engine::triggerReads(this);
+            }
+      }
+
+      bool TcpListener::startDrain() {
+            Engine::remove(self);
+            return false;
+      }
+
+      HandlerKind TcpListener::handlerKind() const {
+            return HandlerKind::TcpListener;
+      }
+
+      void TcpListener::createStream(const int connFd, InetDest const& peer) {
             auto client = clientFactory();
-            TcpStream::create(client, connFd);
+            auto limiter = clientLimiter(peer);
+            if(options.perStreamRate != 0) {
+                  limiter = RateLimiter::create(options.perStreamRate, 0, limiter);
+            }
+            auto const totals = peer.valid && peer.path.empty() ? TrafficTotals::get(name, peer.addr.toString(), traffic) : traffic;
+            TcpStream::create(client, connFd, limiter, totals);
+      }
+
+      std::shared_ptr<RateLimiter> TcpListener::clientLimiter(InetDest const& peer) {
+            if(options.perClientRate == 0 || !peer.valid) {
+                  return options.rateLimiter;
+            }
+            std::lock_guard<std::mutex> sync(lock);
+            auto& entry = clientLimiters[peer.addr.d];
+            auto limiter = entry.lock();
+            if(!limiter) {
+                  limiter = RateLimiter::create(options.perClientRate, 0, options.rateLimiter);
+                  entry = limiter;
+                  if(clientLimiters.size() > 2 * prunedAt) {
+                        for(auto it = clientLimiters.begin(); it != clientLimiters.end();) {
+                              it = it->second.expired() ? clientLimiters.erase(it) : std::next(it);
+                        }
+                        prunedAt = clientLimiters.size();
+                  }
+            }
+            return limiter;
       }
 }
@@ -1,19 +1,88 @@
 ﻿#pragma once
+#include <map>
 #include <memory>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
 #include "socket.hpp"
 #include "tcpstream.hpp"
+#include "ratelimiter.hpp"
 
 namespace Sb {
+      // Engine load above which a listener stops admitting connections; a zero limit is not checked.
+      // Admission resumes once every checked signal is back below resumeRatio of its limit.
+      class AdmissionLimits final {
+      public:
+            enum class Shed {
+                  PauseAccept, AcceptAndClose
+            };
+            std::size_t maxQueueDepth = 0;
+            NanoSecs maxQueueWait{0};
+            std::size_t maxConnections = 0;
+            double resumeRatio = 0.75;
+            Shed shed = Shed::PauseAccept;
+            NanoSecs recheckInterval{10 * ONE_MS_IN_NS};
+      };
+
+      class AdmissionStats final {
+      public:
+            // The listener's handover name, as in its traffic totals.
+            std::string listener;
+            uint64_t accepted = 0;
+            uint64_t shed = 0;
+            uint64_t pauses = 0;
+      };
+
+      class ListenerOptions final {
+      public:
+            int backlog = SOMAXCONN;
+            Seconds deferAccept{0};
+            int fastOpenQueue = 0;
+            bool reusePort = false;
+            std::shared_ptr<RateLimiter> rateLimiter;
+            bitsPerSecond perClientRate = 0;
+            bitsPerSecond perStreamRate = 0;
+            AdmissionLimits admission;
+            // Local address for port listeners; empty binds every interface.
+            std::string address;
+      };
+
       class TcpListener final : virtual public Socket {
       public:
-            static void create(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory);
+            static void create(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory,
+                               ListenerOptions const& options = ListenerOptions());
+            static void create(std::string const& path, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory,
+                               ListenerOptions const& options = ListenerOptions());
+            // One entry per live listener.
+            static std::vector<AdmissionStats> admissionStats();
             virtual ~TcpListener();
-            TcpListener(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory);
+            TcpListener(uint16_t const port, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory, ListenerOptions const& options);
+            TcpListener(std::string const& path, std::function<std::shared_ptr<TcpStreamIf>()> const& clientFactory, ListenerOptions const& options);
       private:
             virtual void handleRead() override;
+            virtual bool waitingInEvent() override;
+            virtual bool startDrain() override;
+            virtual HandlerKind handlerKind() const override;
       private:
-            void createStream(const int newFd);
+            bool admit();
+            bool overloaded(double const ratio) const;
+            void asyncAdmission();
+            void createStream(const int newFd, InetDest const& peer);
+            std::shared_ptr<RateLimiter> clientLimiter(InetDest const& peer);
             std::function<std::shared_ptr<TcpStreamIf>()> clientFactory;
+            ListenerOptions const options;
             std::mutex lock;
+            std::map<std::array<uint16_t, ADDR_LEN_SIZE_T>, std::weak_ptr<RateLimiter>> clientLimiters;
+            std::size_t prunedAt = 0;
+            std::atomic_bool shedding{false};
+            Event admissionCheck;
+            // The handover name, which also keys this listener's traffic totals.
+            std::string name;
+            std::shared_ptr<TrafficTotals> traffic;
+            std::atomic<uint64_t> numAccepted{0};
+            std::atomic<uint64_t> numShed{0};
+            std::atomic<uint64_t> numPauses{0};
+            static std::mutex registryLock;
+            static std::map<std::string, std::weak_ptr<TcpListener>> listeners;
       };
 }
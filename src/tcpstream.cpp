@@ -1,28 +1,57 @@
-﻿#include "logger.hpp"
+﻿#include <fcntl.h>
+#include <unistd.h>
+#include "logger.hpp"
 #include "tcpstream.hpp"
 
 namespace Sb {
-      void TcpStream::create(std::shared_ptr<TcpStreamIf> const& client, int const fd) {
+      void TcpStreamIf::peerClosedWrite() {
+            auto ref = tcpStream.lock();
+            if(ref) {
+                  ref->shutdownWrite();
+            }
+      }
+
+      void TcpStreamIf::drain() {
+            auto ref = tcpStream.lock();
+            if(ref) {
+                  ref->shutdownWrite();
+            }
+      }
+
+      void TcpStream::create(std::shared_ptr<TcpStreamIf> const& client, int const fd, std::shared_ptr<RateLimiter> const& limiter,
+                             std::shared_ptr<TrafficTotals> const& totals) {
             auto ref = std::make_shared<TcpStream>(client, fd);
             client->tcpStream = ref;
-            ref->notifyWriteComplete = Event(ref, std::bind(&TcpStream::asyncWriteComplete, ref));
-            ref->activity = Event(ref, std::bind(&TcpStream::asyncDisconnect, ref));
-            ref->egress = Event(ref, std::bind(&TcpStream::asyncEgress, ref));
+            ref->notifyWriteComplete = Event(ref, std::bind(&TcpStream::asyncWriteComplete, ref.get()));
+            ref->activity = Event(ref, std::bind(&TcpStream::asyncDisconnect, ref.get()));
+            ref->egress = Event(ref, std::bind(&TcpStream::asyncEgress, ref.get()));
+            ref->notifyWatermark = Event(ref, std::bind(&TcpStream::asyncWatermark, ref.get()));
+            ref->notifyPeerClosed = Event(ref, std::bind(&TcpStream::asyncPeerClosed, ref.get()));
+            ref->notifyDrain = Event(ref, std::bind(&TcpStream::asyncDrain, ref.get()));
             ref->connected = true;
-            Engine::runAsync(ref->notifyWriteComplete);
-            { ref->originalDestination();
-             ref->egressRate = 4096 * 1024; }
+            Engine::runAsync(ref->notifyWriteComplete, ref->priority);
+            if(ref->type == TCP) {
+                  ref->setEgressRate(4096 * 1024);
+            }
+            ref->rateLimiter = limiter;
+            ref->counters.setTotals(totals);
             std::shared_ptr<Socket> sockRef = ref;
-            Engine::add(sockRef);
+            Engine::add(sockRef, ref->streamPriority);
       }
 
-      void TcpStream::create(std::shared_ptr<TcpStreamIf> const& client, InetDest const& dest) {
-            auto ref = std::make_shared<TcpStream>(client);
+      void TcpStream::create(std::shared_ptr<TcpStreamIf> const& client, InetDest const& dest, bool const fastOpen) {
+            auto ref = std::make_shared<TcpStream>(client, dest.path.size() > 0 ? UNIX_STREAM : TCP);
             client->tcpStream = ref;
-            ref->notifyWriteComplete = Event(ref, std::bind(&TcpStream::asyncWriteComplete, ref));
-            ref->activity = Event(ref, std::bind(&TcpStream::asyncDisconnect, ref));
-            ref->egress = Event(ref, std::bind(&TcpStream::asyncEgress, ref));
-
+            ref->notifyWriteComplete = Event(ref, std::bind(&TcpStream::asyncWriteComplete, ref.get()));
+            ref->activity = Event(ref, std::bind(&TcpStream::asyncDisconnect, ref.get()));
+            ref->egress = Event(ref, std::bind(&TcpStream::asyncEgress, ref.get()));
+            ref->notifyWatermark = Event(ref, std::bind(&TcpStream::asyncWatermark, ref.get()));
+            ref->notifyPeerClosed = Event(ref, std::bind(&TcpStream::asyncPeerClosed, ref.get()));
+            ref->notifyDrain = Event(ref, std::bind(&TcpStream::asyncDrain, ref.get()));
+            ref->peer = dest;
+            if(fastOpen) {
+                  ref->fastOpenConnect();
+            }
             auto const err = ref->connect(dest);
             if(err >= 0) {
                   ref->connected = true;
@@ -34,15 +63,15 @@ namespace Sb {
                   pErrorLog(err, ref->fd);
                   return;
             }
+            // Connection setup runs as control work; the stream takes its own class once connected.
             std::shared_ptr<Socket> sockRef = ref;
-            Engine::add(sockRef);
+            Engine::add(sockRef, err >= 0 ? ref->streamPriority.load() : Priority::Control);
       }
 
-      TcpStream::TcpStream(std::shared_ptr<TcpStreamIf> const& client) : Socket(TCP), client(client) {
+      TcpStream::TcpStream(std::shared_ptr<TcpStreamIf> const& client, SockType const type) : Socket(type), client(client) {
       }
 
-      TcpStream::TcpStream(std::shared_ptr<TcpStreamIf> const& client, int const fd) : Socket(TCP, fd), client(client) {
-            makeNonBlocking();
+      TcpStream::TcpStream(std::shared_ptr<TcpStreamIf> const& client, int const fd) : Socket(typeOf(fd), fd), client(client) {
       }
 
       TcpStream::~TcpStream() {
@@ -56,7 +85,7 @@ namespace Sb {
 
       void TcpStream::handleRead() {
             std::lock_guard<std::mutex> sync(readLock);
-            for(; ;) {
+            while(!readPaused) {
                   Bytes data(MAX_PACKET_SIZE);
                   auto const actuallyRead = read(data);
                   if(actuallyRead > 0) {
@@ -66,6 +95,7 @@ namespace Sb {
                               client->received(data);
                         }
                    } else if(actuallyRead == 0) {
+                        readClosed();
                         break;
                   } else if(actuallyRead == -1) {
                         break;
@@ -83,16 +113,52 @@ namespace Sb {
                   auto const start = SteadyClock::now();
                   ssize_t totalWritten = 0;
                   bool wasEmpty = (writeQueue.size() == 0);
+                  bool const corked = coalescing == Coalescing::Cork && writeQueue.size() > 1;
+                  bool heldBack = false;
+                  if(corked) {
+                        setCork(true);
+                  }
                   for(; ;) {
                         if(writeQueue.size() == 0) {
                               break;
                         } else {
-                              auto const data = writeQueue.front();
+                              auto entry = std::move(writeQueue.front());
                               writeQueue.pop_front();
-                              auto const actuallySent = write(data);
+                              bool zeroCopied = false;
+                              bool const more = coalescing == Coalescing::MsgMore && writeQueue.size() > 0;
+                              std::size_t granted = 0;
+                              if(rateLimiter) {
+                                    granted = entry.file ? std::min<std::size_t>(entry.length, MAX_PACKET_SIZE) : entry.data.size();
+                                    auto const wait = rateLimiter->acquire(granted);
+                                    if(wait.count() > 0) {
+                                          writeQueue.push_front(std::move(entry));
+                                          writeTriggered = true;
+                                          blocked = true;
+                                          throttled = true;
+                                          Engine::setTimer(egress, wait);
+                                          break;
+                                    }
+                              }
+                              auto const actuallySent = writeEntry(entry, zeroCopied, more);
+                              if(granted > static_cast<std::size_t>(std::max<ssize_t>(actuallySent, 0))) {
+                                    rateLimiter->release(granted - std::max<ssize_t>(actuallySent, 0));
+                              }
                               if(actuallySent >= 0) {
-                                    if((actuallySent - data.size()) != 0) {
-                                          writeQueue.push_front(Bytes(data.begin() + actuallySent, data.end()));
+                                    heldBack = more;
+                                    queuedBytes -= actuallySent;
+                                    if(entry.file) {
+                                          entry.length -= actuallySent;
+                                          if(entry.length != 0 && actuallySent != 0) {
+                                                writeQueue.push_front(std::move(entry));
+                                          } else if(entry.length != 0) {
+                                                logError("TcpStream::handleWrite file region ended early " + std::to_string(entry.length));
+                                                queuedBytes -= entry.length;
+                                          }
+                                    } else if((actuallySent - entry.data.size()) != 0) {
+                                          writeQueue.push_front(WriteEntry{Bytes(entry.data.begin() + actuallySent, entry.data.end()), nullptr, 0, 0});
+                                    }
+                                    if(zeroCopied) {
+                                          zeroCopyPending.emplace_back(zeroCopySeq++, std::move(entry.data));
                                     }
                                     counters.notifyEgress(actuallySent);
                                     Engine::setTimer(activity, inactivityTimeout);
@@ -105,6 +171,7 @@ namespace Sb {
                                     if(egressRate != 0 && currentRate > egressRate) {
                                           writeTriggered = true;
                                           blocked = true;
+                                          throttled = true;
                                           auto const nextWriteAt = MAX_PACKET_SIZE * ONE_SEC_IN_NS / egressRate;
                                           Engine::setTimer(egress, NanoSecs{nextWriteAt});
                                           break;
@@ -112,42 +179,123 @@ namespace Sb {
                                           continue;
                                     }
                               } else if(actuallySent == -1) {
-                                    writeQueue.push_front(data);
+                                    writeQueue.push_front(std::move(entry));
                                     blocked = true;
                                     break;
                               } else {
+                                    // The stream is broken: the entry is dropped, and with it its share of the queue.
+                                    queuedBytes -= entry.file ? entry.length : entry.data.size();
+                                    if(!disconnecting) {
+                                          disconnecting = true;
+                                          Engine::remove(self);
+                                    }
                                     break;
                               }
                         }
                   }
-                  bool isEmpty = (writeQueue.size() == 0);
+                  if(corked) {
+                        setCork(false);
+                  } else if(heldBack) {
+                        pushPending();
+                  }
+                  if(closeWriteWhenFlushed && writeQueue.size() == 0) {
+                        closeWrite();
+                  }
+                  if(aboveHighWatermark && queuedBytes <= lowWatermark) {
+                        aboveHighWatermark = false;
+                        Engine::runAsync(notifyWatermark, priority);
+                  }
+                  bool isEmpty = (writeQueue.size() == 0 && zeroCopyPending.size() == 0);
                   if(!once || (!wasEmpty && isEmpty)) {
                         once = true;
-                        Engine::runAsync(notifyWriteComplete);
+                        Engine::runAsync(notifyWriteComplete, priority);
+                  }
+            } else if(pendingError() != 0) {
+                  if(!disconnecting) {
+                        disconnecting = true;
+                        Engine::remove(self);
                   }
             } else {
                   connected = true;
+                  priority = streamPriority.load();
                   Engine::setTimer(activity, inactivityTimeout);
                   if(writeQueue.size() > 0) {
                         writeTriggered = true;
                         Engine::triggerWrites(this);
                   } else {
-                        Engine::runAsync(notifyWriteComplete);
+                        if(closeWriteWhenFlushed) {
+                              closeWrite();
+                        }
+                        Engine::runAsync(notifyWriteComplete, priority);
                   }
             }
       }
 
+      ssize_t TcpStream::writeEntry(WriteEntry& entry, bool& zeroCopied, bool const more) {
+            if(entry.file) {
+                  auto const chunk = (egressRate == 0 && !rateLimiter) ? entry.length : std::min<std::size_t>(entry.length, MAX_PACKET_SIZE);
+                  return sendFile(*entry.file, entry.offset, chunk);
+            } else if(zeroCopyThreshold != 0 && entry.data.size() >= zeroCopyThreshold) {
+                  return writeZeroCopy(entry.data, zeroCopied, more);
+            } else {
+                  return write(entry.data, more);
+            }
+      }
+
       bool TcpStream::waitingOutEvent() {
             std::lock_guard<std::mutex> sync(writeLock);
-            return (blocked || !once || !connected) && !disconnecting && (!connected || egressRate == 0);
+            return (blocked || !once || !connected) && !disconnecting && !throttled;
+      }
+
+      bool TcpStream::waitingInEvent() {
+            return !readPaused && !peerClosed;
+      }
+
+      void TcpStream::pauseReading() {
+            readPaused = true;
+      }
+
+      void TcpStream::resumeReading() {
+            if(readPaused.exchange(false)) {
+                  Engine::triggerReads(this);
+            }
       }
 
       void TcpStream::asyncEgress() {
             std::lock_guard<std::mutex> sync(writeLock);
             assert(writeTriggered, "Cannot run without being triggered");
+            throttled = false;
             Engine::triggerWrites(this);
       }
 
+      void TcpStream::asyncWatermark() {
+            std::lock_guard<std::mutex> sync(watermarkLock);
+            bool above = false;
+            {
+                  std::lock_guard<std::mutex> syncWrite(writeLock);
+                  above = aboveHighWatermark;
+                  if(above == reportedAboveHighWatermark) {
+                        return;
+                  }
+                  reportedAboveHighWatermark = above;
+            }
+            if(!client) {
+                  return;
+            } else if(above) {
+                  client->writeBlocked();
+            } else {
+                  client->writeUnblocked();
+            }
+      }
+
+      void TcpStream::queued(std::size_t const bytes) {
+            queuedBytes += bytes;
+            if(highWatermark != 0 && !aboveHighWatermark && queuedBytes >= highWatermark) {
+                  aboveHighWatermark = true;
+                  Engine::runAsync(notifyWatermark, priority);
+            }
+      }
+
       void TcpStream::asyncWriteComplete() {
             if(client) {
                   client->writeComplete();
@@ -163,6 +311,90 @@ namespace Sb {
             disconnect();
       }
 
+      bool TcpStream::handleErrorQueue() {
+            std::lock_guard<std::mutex> sync(writeLock);
+            if(zeroCopyThreshold == 0 && zeroCopyPending.size() == 0) {
+                  return false;
+            }
+            bool completed = false;
+            uint32_t first;
+            uint32_t last;
+            while(zeroCopyCompleted(first, last)) {
+                  completed = true;
+                  while(zeroCopyPending.size() > 0 && static_cast<int32_t>(zeroCopyPending.front().first - last) <= 0) {
+                        zeroCopyPending.pop_front();
+                  }
+            }
+            if(completed && zeroCopyPending.size() == 0 && writeQueue.size() == 0) {
+                  Engine::runAsync(notifyWriteComplete, priority);
+            }
+            return completed && pendingError() == 0;
+      }
+
+      // EPOLLRDHUP only hints that the peer half-closed: data queued before the FIN may still be unread, and a
+      // paused reader must not see the close ahead of it. The zero-length read in handleRead reports it instead.
+      bool TcpStream::handlePeerClosed() {
+            if(!readPaused && !peerClosed) {
+                  handleRead();
+            }
+            return true;
+      }
+
+      void TcpStream::readClosed() {
+            if(!peerClosed.exchange(true)) {
+                  Engine::runAsync(notifyPeerClosed, priority);
+                  if(writeClosed) {
+                        disconnect();
+                  }
+            }
+      }
+
+      void TcpStream::asyncPeerClosed() {
+            if(client) {
+                  client->peerClosedWrite();
+            }
+      }
+
+      bool TcpStream::startDrain() {
+            Engine::runAsync(notifyDrain, priority);
+            return true;
+      }
+
+      std::size_t TcpStream::pendingBytes() {
+            return writeQueueSize();
+      }
+
+      HandlerKind TcpStream::handlerKind() const {
+            return HandlerKind::TcpStream;
+      }
+
+      void TcpStream::asyncDrain() {
+            if(client) {
+                  client->drain();
+            }
+      }
+
+      void TcpStream::shutdownWrite() {
+            std::lock_guard<std::mutex> sync(writeLock);
+            if(closeWriteWhenFlushed || disconnecting) {
+                  return;
+            }
+            closeWriteWhenFlushed = true;
+            if(connected && writeQueue.size() == 0) {
+                  closeWrite();
+            }
+      }
+
+      void TcpStream::closeWrite() {
+            if(!writeClosed.exchange(true)) {
+                  Socket::shutdownWrite();
+                  if(peerClosed && !disconnecting) {
+                        disconnecting = true;
+                        Engine::remove(self);
+                  }
+            }
+      }
+
       void TcpStream::disconnect() {
             std::lock_guard<std::mutex> sync(writeLock);
             if(!disconnecting) {
@@ -173,10 +405,33 @@ namespace Sb {
 
       void TcpStream::queueWrite(Bytes const& data) {
             std::lock_guard<std::mutex> sync(writeLock);
-            if(data.size() == 0) {
+            if(data.size() == 0 || closeWriteWhenFlushed) {
                   return;
             }
-            writeQueue.push_back(data);
+            writeQueue.push_back(WriteEntry{data, nullptr, 0, 0});
+            queued(data.size());
+            if(connected && !blocked && !writeTriggered) {
+                  writeTriggered = true;
+                  Engine::triggerWrites(this);
+            }
+      }
+
+      void TcpStream::queueWrite(int const fileFd, off_t const offset, std::size_t const length) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            if(length == 0 || closeWriteWhenFlushed) {
+                  return;
+            }
+            auto const dupFd = ::fcntl(fileFd, F_DUPFD_CLOEXEC, 0);
+            if(dupFd < 0) {
+                  pErrorLog(dupFd, fileFd);
+                  return;
+            }
+            std::shared_ptr<int> file(new int(dupFd), [](int* const what) {
+                  ::close(*what);
+                  delete what;
+            });
+            writeQueue.push_back(WriteEntry{{}, file, offset, length});
+            queued(length);
             if(connected && !blocked && !writeTriggered) {
                   writeTriggered = true;
                   Engine::triggerWrites(this);
@@ -185,7 +440,70 @@ namespace Sb {
 
       bool TcpStream::writeQueueEmpty() {
             std::lock_guard<std::mutex> sync(writeLock);
-            return writeQueue.size() == 0;
+            return writeQueue.size() == 0 && zeroCopyPending.size() == 0;
+      }
+
+      std::size_t TcpStream::writeQueueSize() {
+            std::lock_guard<std::mutex> sync(writeLock);
+            return queuedBytes;
+      }
+
+      void TcpStream::setWriteWatermarks(std::size_t const low, std::size_t const high) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            highWatermark = high;
+            lowWatermark = std::min(low, high);
+            if(aboveHighWatermark && (high == 0 || queuedBytes <= lowWatermark)) {
+                  aboveHighWatermark = false;
+                  Engine::runAsync(notifyWatermark, priority);
+            } else if(!aboveHighWatermark && high != 0 && queuedBytes >= high) {
+                  aboveHighWatermark = true;
+                  Engine::runAsync(notifyWatermark, priority);
+            }
+      }
+
+      void TcpStream::setZeroCopyThreshold(std::size_t const minSize) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            zeroCopyThreshold = (minSize != 0 && enableZeroCopy()) ? minSize : 0;
+      }
+
+      void TcpStream::setEgressRate(bitsPerSecond const rate, bool const kernelPacing) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            if(kernelPacing && setMaxPacingRate(rate == 0 ? UNLIMITED_PACING_RATE : rate)) {
+                  kernelPaced = rate != 0;
+                  egressRate = 0;
+            } else {
+                  if(kernelPaced) {
+                        setMaxPacingRate(UNLIMITED_PACING_RATE);
+                        kernelPaced = false;
+                  }
+                  egressRate = rate;
+            }
+      }
+
+      bool TcpStream::kernelPacing() const {
+            return kernelPaced;
+      }
+
+      void TcpStream::setRateLimiter(std::shared_ptr<RateLimiter> const& limiter) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            rateLimiter = limiter;
+      }
+
+      void TcpStream::setPriority(Priority const newPriority) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            streamPriority = newPriority;
+            if(connected) {
+                  priority = newPriority;
+            }
+      }
+
+      void TcpStream::setCoalescing(Coalescing const policy) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            coalescing = policy;
+      }
+
+      uint32_t TcpStream::segmentsSent() const {
+            return Socket::segmentsSent();
       }
 
       bool TcpStream::didConnect() const {
@@ -195,5 +513,46 @@ namespace Sb {
       InetDest TcpStream::endPoint() const {
             return originalDestination();
       }
+
+      InetDest TcpStream::peerEndPoint() const {
+            return peer;
+      }
+
+      bool TcpStream::reusable() {
+            std::lock_guard<std::mutex> sync(writeLock);
+            return connected && !disconnecting && !peerClosed && !closeWriteWhenFlushed && writeQueue.size() == 0 && zeroCopyPending.size() == 0 &&
+                   pendingError() == 0 && unreadBytes() == 0;
+      }
+
+      void TcpStream::rebind(std::shared_ptr<TcpStreamIf> const& newClient, Bytes const& unread) {
+            {
+                  std::lock_guard<std::mutex> syncWrite(writeLock);
+                  std::lock_guard<std::mutex> syncRead(readLock);
+                  std::lock_guard<std::mutex> syncWatermark(watermarkLock);
+                  client = newClient;
+                  newClient->tcpStream = std::static_pointer_cast<TcpStream>(self.lock());
+                  reportedAboveHighWatermark = false;
+                  aboveHighWatermark = false;
+                  streamPriority = Priority::Normal;
+                  priority = Priority::Normal;
+                  Engine::runAsync(notifyWriteComplete, priority);
+            }
+            if(unread.size() > 0) {
+                  std::lock_guard<std::mutex> syncRead(readLock);
+                  if(client) {
+                        client->received(unread);
+                  }
+            }
+            resumeReading();
+      }
+
+      NanoSecs TcpStream::getInactivityTimeout() const {
+            return inactivityTimeout;
+      }
+
+      void TcpStream::setInactivityTimeout(NanoSecs const timeout) {
+            inactivityTimeout = timeout;
+            Engine::setTimer(activity, timeout);
+      }
 }
 
@@ -5,6 +5,7 @@
 #include "socket.hpp"
 #include "types.hpp"
 #include "counters.hpp"
+#include "ratelimiter.hpp"
 
 namespace Sb {
       class TcpStream;
@@ -16,47 +17,120 @@ namespace Sb {
             virtual void received(Bytes const&) = 0;
             virtual void writeComplete() = 0;
             virtual void disconnected() = 0;
+            virtual void writeBlocked() {
+            }
+            virtual void writeUnblocked() {
+            }
+            virtual void peerClosedWrite();
+            // The engine is draining; the default closes the stream once its writes are flushed.
+            virtual void drain();
       protected:
             std::weak_ptr<TcpStream> tcpStream;
       };
 
       class TcpStream : public Socket {
       public:
-            static void create(std::shared_ptr<TcpStreamIf> const& client, int const fd);
-            static void create(std::shared_ptr<TcpStreamIf> const& client, InetDest const&dest);
+            enum class Coalescing {
+                  None, MsgMore, Cork
+            };
+            static void create(std::shared_ptr<TcpStreamIf> const& client, int const fd, std::shared_ptr<RateLimiter> const& limiter = nullptr,
+                               std::shared_ptr<TrafficTotals> const& totals = nullptr);
+            static void create(std::shared_ptr<TcpStreamIf> const& client, InetDest const&dest, bool const fastOpen = false);
             void queueWrite(const Bytes&data);
+            void queueWrite(int const fileFd, off_t const offset, std::size_t const length);
             void disconnect();
-            TcpStream(std::shared_ptr<TcpStreamIf> const& client);
+            void shutdownWrite();
+            TcpStream(std::shared_ptr<TcpStreamIf> const& client, SockType const type);
             TcpStream(std::shared_ptr<TcpStreamIf> const& client, int const fd);
             virtual ~TcpStream();
             bool didConnect() const;
             InetDest endPoint() const;
+            InetDest peerEndPoint() const;
+            bool reusable();
+            void rebind(std::shared_ptr<TcpStreamIf> const& newClient, Bytes const& unread = Bytes());
+            void setInactivityTimeout(NanoSecs const timeout);
+            NanoSecs getInactivityTimeout() const;
             bool writeQueueEmpty();
+            std::size_t writeQueueSize();
+            void setWriteWatermarks(std::size_t const low, std::size_t const high);
+            void pauseReading();
+            void resumeReading();
+            void setZeroCopyThreshold(std::size_t const minSize);
+            void setCoalescing(Coalescing const policy);
+            // Moves this stream's events to another run-queue class; rebind resets it to Normal.
+            void setPriority(Priority const newPriority);
+            void setEgressRate(bitsPerSecond const rate, bool const kernelPacing = true);
+            bool kernelPacing() const;
+            void setRateLimiter(std::shared_ptr<RateLimiter> const& limiter);
+            uint32_t segmentsSent() const;
       protected:
             virtual void handleRead() override;
             virtual void handleWrite() override;
             virtual void handleError() override;
+            virtual bool handleErrorQueue() override;
+            virtual bool handlePeerClosed() override;
             virtual bool waitingOutEvent() override;
+            virtual bool waitingInEvent() override;
+            virtual bool startDrain() override;
+            virtual std::size_t pendingBytes() override;
+            virtual HandlerKind handlerKind() const override;
       private:
+            class WriteEntry final {
+            public:
+                  Bytes data;
+                  std::shared_ptr<int> file;
+                  off_t offset;
+                  std::size_t length;
+            };
+
+            ssize_t writeEntry(WriteEntry& entry, bool& zeroCopied, bool const more);
             virtual void asyncWriteComplete();
             virtual void asyncDisconnect();
             virtual void asyncEgress();
+            virtual void asyncWatermark();
+            virtual void asyncPeerClosed();
+            virtual void asyncDrain();
+            void closeWrite();
+            void readClosed();
+            void queued(std::size_t const bytes);
       private:
             std::shared_ptr<TcpStreamIf> client;
             std::mutex writeLock;
             std::mutex readLock;
-            std::deque<Bytes> writeQueue;
+            std::mutex watermarkLock;
+            std::deque<WriteEntry> writeQueue;
             bool blocked = false;
+            bool throttled = false;
+            std::atomic_bool kernelPaced{false};
+            std::atomic_bool readPaused{false};
+            std::atomic_bool peerClosed{false};
+            std::atomic_bool writeClosed{false};
+            bool closeWriteWhenFlushed = false;
             bool once = false;
             bool writeTriggered = false;
             bool connected = false;
+            std::atomic<Priority> streamPriority{Priority::Normal};
             bool disconnecting = false;
             Event notifyWriteComplete;
             Event activity;
             Event egress;
+            Event notifyWatermark;
+            Event notifyPeerClosed;
+            Event notifyDrain;
             bitsPerSecond egressRate = 0; //8ULL * 1024ULL * 1024ULL;
             Counters counters;
-            NanoSecs inactivityTimeout = NanoSecs{60 * ONE_SEC_IN_NS};
+            std::shared_ptr<RateLimiter> rateLimiter;
+            Coalescing coalescing = Coalescing::MsgMore;
+            std::size_t zeroCopyThreshold = 0;
+            uint32_t zeroCopySeq = 0;
+            std::deque<std::pair<uint32_t, Bytes>> zeroCopyPending;
+            std::size_t queuedBytes = 0;
+            std::size_t lowWatermark = 256 * 1024;
+            std::size_t highWatermark = 1024 * 1024;
+            bool aboveHighWatermark = false;
+            bool reportedAboveHighWatermark = false;
+            InetDest peer{};
+            std::atomic<NanoSecs> inactivityTimeout{NanoSecs{60 * ONE_SEC_IN_NS}};
       };
 }
 
@@ -9,13 +9,15 @@ namespace Sb {
       Timers::~Timers() {
       }
 
-      void Timers::handleTimerExpired() {
+      TimePointNs Timers::handleTimerExpired() {
             std::lock_guard<std::mutex> sync(timeLock);
             assert(timesByDate.size() > 0, "Expired timer not found");
+            auto const due = timesByDate.begin()->first;
             auto ev = timesByDate.begin()->second.ep;
             auto event = timesByDate.begin()->second.id;
             removeTimer(ev, event);
             setTrigger();
+            return due;
       }
 
       TimePointNs Timers::removeTimer(Runnable const* const what, Event const* const timer) {
@@ -112,6 +114,11 @@ namespace Sb {
             }
       }
 
+      std::size_t Timers::size() {
+            std::lock_guard<std::mutex> sync(timeLock);
+            return timesByDate.size();
+      }
+
       void Timers::clear() {
             timesByDate.clear();
             timersByOwner.clear();
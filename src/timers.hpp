@@ -36,8 +36,10 @@ namespace Sb {
             void cancelAllTimers(Runnable const* const what);
             NanoSecs setTimer(Event const& timer, NanoSecs const& timeout);
             NanoSecs cancelTimer(Event const& timer);
-            void handleTimerExpired();
+            // Returns when the expired timer was due.
+            TimePointNs handleTimerExpired();
             void clear();
+            std::size_t size();
       private:
             void setTrigger();
             TimePointNs removeTimer(Runnable const* const what, Event const* const timer);
@@ -0,0 +1,190 @@
+﻿#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+#include "trace.hpp"
+#include "utils.hpp"
+
+namespace Sb {
+      // Fields are relaxed atomics so that a dump may read a ring while its thread keeps writing.
+      class Trace::Record final {
+      public:
+            std::atomic<int64_t> start{0};
+            std::atomic<int64_t> duration{0};
+            std::atomic<int64_t> wait{0};
+            std::atomic<uint64_t> evId{0};
+            std::atomic<uint32_t> events{0};
+            std::atomic<uint8_t> kind{0};
+            std::atomic<uint8_t> handler{0};
+      };
+
+      class Trace::Ring final {
+      public:
+            explicit Ring(std::size_t const tid) {
+                  reset(tid);
+            }
+
+            // Only under Trace::lock, and only while no thread or dump holds the ring.
+            void reset(std::size_t const newTid) {
+                  tid = newTid;
+                  name = "thread " + std::to_string(newTid);
+                  head.store(0, std::memory_order_relaxed);
+            }
+
+            std::size_t tid;
+            std::string name;
+            std::atomic<uint64_t> head{0};
+            std::array<Record, TRACE_RING_SIZE> records;
+      };
+
+      std::atomic_bool Trace::on{true};
+      std::mutex Trace::lock;
+      std::vector<std::shared_ptr<Trace::Ring>> Trace::rings;
+      std::size_t Trace::lastTid = 0;
+      std::string Trace::path = "/tmp/sblade-trace-" + std::to_string(::getpid()) + ".json";
+
+      void Trace::setEnabled(bool const enable) {
+            on = enable;
+      }
+
+      bool Trace::enabled() {
+            return on.load(std::memory_order_relaxed);
+      }
+
+      Trace::Ring& Trace::thisThread() {
+            thread_local std::shared_ptr<Ring> ring;
+            if(!ring) {
+                  std::lock_guard<std::mutex> sync(lock);
+                  // Workers come and go, so a ring whose thread has exited is taken over rather than kept
+                  // forever. Only the table then holds it; references are taken under the lock alone.
+                  for(auto const& spare : rings) {
+                        if(spare.use_count() == 1) {
+                              spare->reset(++lastTid);
+                              ring = spare;
+                              return *ring;
+                        }
+                  }
+                  ring = std::make_shared<Ring>(++lastTid);
+                  rings.push_back(ring);
+            }
+            return *ring;
+      }
+
+      void Trace::nameThread(std::string const& name) {
+            auto& ring = thisThread();
+            std::lock_guard<std::mutex> sync(lock);
+            ring.name = name;
+      }
+
+      void Trace::add(TraceKind const kind, int64_t const start, int64_t const duration, int64_t const wait, uint64_t const evId, uint32_t const events,
+                      HandlerKind const handler) {
+            auto& ring = thisThread();
+            auto const head = ring.head.load(std::memory_order_relaxed);
+            auto& record = ring.records[head % TRACE_RING_SIZE];
+            record.start.store(start, std::memory_order_relaxed);
+            record.duration.store(duration, std::memory_order_relaxed);
+            record.wait.store(wait, std::memory_order_relaxed);
+            record.evId.store(evId, std::memory_order_relaxed);
+            record.events.store(events, std::memory_order_relaxed);
+            record.kind.store(static_cast<uint8_t>(kind), std::memory_order_relaxed);
+            record.handler.store(static_cast<uint8_t>(handler), std::memory_order_relaxed);
+            ring.head.store(head + 1, std::memory_order_release);
+      }
+
+      void Trace::dispatch(TimePointNs const& queuedAt, TimePointNs const& start, TimePointNs const& end, HandlerKind const kind, uint64_t const evId,
+                           uint32_t const events) {
+            if(enabled()) {
+                  add(TraceKind::Dispatch, start.time_since_epoch().count(), Clock::elapsed(start, end).count(), Clock::elapsed(queuedAt, start).count(), evId,
+                      events, kind);
+            }
+      }
+
+      void Trace::timerFired(TimePointNs const& due, TimePointNs const& now) {
+            if(enabled()) {
+                  add(TraceKind::TimerFire, now.time_since_epoch().count(), 0, Clock::elapsed(due, now).count(), 0, 0, HandlerKind::Timer);
+            }
+      }
+
+      void Trace::epollWake(TimePointNs const& now, int const events) {
+            if(enabled()) {
+                  add(TraceKind::EpollWake, now.time_since_epoch().count(), 0, 0, 0, static_cast<uint32_t>(events), HandlerKind::Other);
+            }
+      }
+
+      void Trace::setDumpPath(std::string const& dumpPath) {
+            std::lock_guard<std::mutex> sync(lock);
+            path = dumpPath;
+      }
+
+      std::string Trace::dumpPath() {
+            std::lock_guard<std::mutex> sync(lock);
+            return path;
+      }
+
+      bool Trace::dump(std::string const& dumpPath) {
+            std::vector<std::shared_ptr<Ring>> all;
+            std::vector<std::string> names;
+            {
+                  std::lock_guard<std::mutex> sync(lock);
+                  all = rings;
+                  for(auto const& ring : rings) {
+                        names.push_back(ring->name);
+                  }
+            }
+            std::ofstream out(dumpPath, std::ios::trunc);
+            if(!out) {
+                  logError("Trace::dump cannot write " + dumpPath);
+                  return false;
+            }
+            // Chrome trace timestamps are in microseconds.
+            auto const us = [](int64_t const ns) {
+                  std::ostringstream text;
+                  text << std::fixed << std::setprecision(3) << ns / 1000.0;
+                  return text.str();
+            };
+            out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            bool first = true;
+            std::size_t total = 0;
+            for(std::size_t r = 0; r < all.size(); ++r) {
+                  auto const& ring = *all[r];
+                  out << (first ? "" : ",") << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << ring.tid << ",\"args\":{\"name\":\"" << names[r]
+                      << "\"}}";
+                  first = false;
+                  auto const head = ring.head.load(std::memory_order_acquire);
+                  auto const begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+                  for(auto i = begin; i < head; ++i) {
+                        auto const& record = ring.records[i % TRACE_RING_SIZE];
+                        auto const start = record.start.load(std::memory_order_relaxed);
+                        auto const duration = record.duration.load(std::memory_order_relaxed);
+                        auto const wait = record.wait.load(std::memory_order_relaxed);
+                        auto const evId = record.evId.load(std::memory_order_relaxed);
+                        auto const events = record.events.load(std::memory_order_relaxed);
+                        auto const kind = static_cast<TraceKind>(record.kind.load(std::memory_order_relaxed));
+                        auto const handler = static_cast<HandlerKind>(record.handler.load(std::memory_order_relaxed));
+                        // The writer may have lapped us while we read; such a record is half new, half old.
+                        if(ring.head.load(std::memory_order_acquire) > i + TRACE_RING_SIZE - 1) {
+                              continue;
+                        }
+                        out << ",\n{\"pid\":1,\"tid\":" << ring.tid << ",\"ts\":" << us(start);
+                        switch(kind) {
+                              case TraceKind::Dispatch:
+                                    out << ",\"ph\":\"X\",\"cat\":\"dispatch\",\"name\":\"" << handlerKindName(handler) << "\",\"dur\":" << us(duration)
+                                        << ",\"args\":{\"evId\":" << evId << ",\"events\":\"" << (events == 0 ? "" : pollEventsToString(events))
+                                        << "\",\"queueWaitUs\":" << us(wait) << "}}";
+                                    break;
+                              case TraceKind::TimerFire:
+                                    out << ",\"ph\":\"i\",\"s\":\"t\",\"cat\":\"timer\",\"name\":\"timer\",\"args\":{\"lagUs\":" << us(wait) << "}}";
+                                    break;
+                              default:
+                                    out << ",\"ph\":\"i\",\"s\":\"t\",\"cat\":\"epoll\",\"name\":\"epoll_wait\",\"args\":{\"events\":" << events << "}}";
+                                    break;
+                        }
+                        ++total;
+                  }
+            }
+            out << "\n]}\n";
+            out.close();
+            logDebug("Trace::dump " + std::to_string(total) + " records to " + dumpPath);
+            return static_cast<bool>(out);
+      }
+}
@@ -0,0 +1,48 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "clock.hpp"
+#include "event.hpp"
+
+namespace Sb {
+      constexpr std::size_t TRACE_RING_SIZE = 4096;
+
+      enum class TraceKind : uint8_t {
+            Dispatch = 0, TimerFire = 1, EpollWake = 2
+      };
+
+      // Fixed-size per-thread rings of what the engine scheduled, cheap enough to leave on: a record is a
+      // handful of relaxed stores into the calling thread's own ring, and the ring of an exited thread is
+      // reused by the next one. dump() writes every ring as Chrome trace / Perfetto JSON, and SIGUSR2
+      // makes the engine dump to dumpPath().
+      class Trace final {
+      public:
+            static void setEnabled(bool const on);
+            static bool enabled();
+            static void nameThread(std::string const& name);
+            static void dispatch(TimePointNs const& queuedAt, TimePointNs const& start, TimePointNs const& end, HandlerKind const kind, uint64_t const evId,
+                                 uint32_t const events);
+            static void timerFired(TimePointNs const& due, TimePointNs const& now);
+            static void epollWake(TimePointNs const& now, int const events);
+            static bool dump(std::string const& path);
+            static void setDumpPath(std::string const& path);
+            static std::string dumpPath();
+      private:
+            class Record;
+            class Ring;
+
+            static Ring& thisThread();
+            static void add(TraceKind const kind, int64_t const start, int64_t const duration, int64_t const wait, uint64_t const evId, uint32_t const events,
+                            HandlerKind const handler);
+      private:
+            static std::atomic_bool on;
+            static std::mutex lock;
+            static std::vector<std::shared_ptr<Ring>> rings;
+            static std::size_t lastTid;
+            static std::string path;
+      };
+}
@@ -12,6 +12,7 @@ namespace Sb {
       typedef uint8_t byte;
       typedef std::vector<byte> Bytes;
       constexpr ssize_t MAX_PACKET_SIZE = 4096;
+      constexpr std::size_t MAX_DATAGRAM_BATCH = 32;
       constexpr ssize_t IP_ADDRESS_BIT_LEN = 128;
       constexpr size_t NUM_BITS_PER_SIZE_T = 8;
       constexpr size_t ADDR_LEN_SIZE_T = IP_ADDRESS_BIT_LEN / sizeof(uint16_t) / NUM_BITS_PER_SIZE_T;
@@ -80,18 +81,27 @@ namespace Sb {
       class InetDest {
       public:
             std::string toString() const {
-                  return addr.toString() + "=>" + std::to_string(port);
+                  return path.size() > 0 ? path : addr.toString() + "=>" + std::to_string(port);
             }
             InetDest& operator=(InetDest const& rhs) {
                   addr = rhs.addr;
                   valid = rhs.valid;
                   port = rhs.port;
                   ifIndex = rhs.ifIndex;
+                  path = rhs.path;
                   return *this;
             }
+            static InetDest unixPath(std::string const& where) {
+                  InetDest dest{};
+                  dest.valid = where.size() > 0;
+                  dest.path = where;
+                  return dest;
+            }
             IpAddr addr;
             bool valid;
             uint16_t port;
             unsigned int ifIndex;
+            // A Unix domain address, empty for IPv6; a leading '@' names the abstract namespace.
+            std::string path;
       };
 }
@@ -1,61 +1,151 @@
-﻿#include "udpsocket.hpp"
+﻿#include <algorithm>
+#include "udpsocket.hpp"
 #include "engine.hpp"
+#include "handover.hpp"
 
 namespace Sb {
+      constexpr std::size_t UdpSocket::MAX_GSO_SEGMENTS;
+      constexpr std::size_t UdpSocket::MAX_GSO_SIZE;
+      constexpr std::size_t UdpSocket::MAX_GRO_SIZE;
+
       void UdpSocket::create(uint16_t const localPort, std::shared_ptr<UdpSocketIf> const& client) {
-            std::shared_ptr<UdpSocket> ref = std::make_shared<UdpSocket>(client);
+            auto const name = "udp:" + std::to_string(localPort);
+            std::shared_ptr<UdpSocket> ref = std::make_shared<UdpSocket>(client, UDP, Handover::adopt(name));
             ref->bindAndAdd(ref, localPort, client);
+            Handover::publish(name, ref);
+      }
+
+      void UdpSocket::create(InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client, Priority const priority) {
+            std::shared_ptr<UdpSocket> ref = std::make_shared<UdpSocket>(client, dest.path.size() > 0 ? UNIX_DGRAM : UDP);
+            ref->connectAndAdd(ref, dest, client, priority);
       }
 
-      void UdpSocket::create(InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client) {
-            std::shared_ptr<UdpSocket> ref = std::make_shared<UdpSocket>(client);
-            ref->connectAndAdd(ref, dest, client);
+      void UdpSocket::create(std::string const& path, std::shared_ptr<UdpSocketIf> const& client) {
+            auto const name = "unix:" + path;
+            std::shared_ptr<UdpSocket> ref = std::make_shared<UdpSocket>(client, UNIX_DGRAM, Handover::adopt(name));
+            ref->bindAndAdd(ref, path, client);
+            Handover::publish(name, ref);
       }
 
-      UdpSocket::UdpSocket(std::shared_ptr<UdpSocketIf> const& client) : Socket(UDP), client(client) {
+      UdpSocket::UdpSocket(std::shared_ptr<UdpSocketIf> const& client, SockType const type, int const inheritedFd)
+                  : Socket(type, inheritedFd), client(client), inherited(inheritedFd >= 0), readBatch(MAX_DATAGRAM_BATCH) {
             logDebug(std::string("UdpClient::UdpClient " + std::to_string(fd)));
             pErrorThrow(fd);
+            for(auto& dgram : readBatch) {
+                  dgram.data.resize(MAX_PACKET_SIZE);
+            }
       }
 
       UdpSocket::~UdpSocket() {
+            Engine::cancelTimer(egress);
       }
 
-      void UdpSocket::connectAndAdd(std::shared_ptr<UdpSocket> const& me, InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client) {
+      void UdpSocket::connectAndAdd(std::shared_ptr<UdpSocket> const& me, InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client, Priority const priority) {
             client->udpSocket = me;
+            egress = Event(me, std::bind(&UdpSocket::asyncEgress, this));
             makeTransparent();
+            if(type == UNIX_DGRAM) {
+                  bindAnonymous();
+            }
             std::shared_ptr<Socket> sockRef = me;
-            Engine::add(sockRef);
+            Engine::add(sockRef, priority);
             connect(dest);
             client->connected(dest);
       }
 
       void UdpSocket::bindAndAdd(std::shared_ptr<UdpSocket> const& me, uint16_t const localPort, std::shared_ptr<UdpSocketIf> const& client) {
             client->udpSocket = me;
+            egress = Event(me, std::bind(&UdpSocket::asyncEgress, this));
             makeTransparent();
             std::shared_ptr<Socket> sockRef = me;
             Engine::add(sockRef);
-            bind(localPort);
+            if(!inherited) {
+                  bind(localPort);
+            }
+      }
+
+      void UdpSocket::bindAndAdd(std::shared_ptr<UdpSocket> const& me, std::string const& path, std::shared_ptr<UdpSocketIf> const& client) {
+            client->udpSocket = me;
+            egress = Event(me, std::bind(&UdpSocket::asyncEgress, this));
+            if(!inherited) {
+                  bind(path);
+            }
+            std::shared_ptr<Socket> sockRef = me;
+            Engine::add(sockRef);
       }
 
       void UdpSocket::handleRead() {
             std::lock_guard<std::mutex> sync(readLock);
-            logDebug("UdpClient::handleRead");
-            Bytes data(MAX_PACKET_SIZE);
-            InetDest from = {{{}}, 0};
-            const auto actuallyReceived = receiveDatagram(from, data);
-            if (actuallyReceived < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-                  logDebug("UdpClient::handleRead would block");
-                  return;
+            for(; ;) {
+                  std::size_t const bufferSize = readBufferSize;
+                  if(readBatch.front().data.size() != bufferSize) {
+                        for(auto& dgram : readBatch) {
+                              dgram.data.resize(bufferSize);
+                        }
+                  }
+                  auto const numReceived = receiveDatagrams(readBatch);
+                  if(numReceived <= 0) {
+                        break;
+                  }
+                  for(int i = 0; i < numReceived; ++i) {
+                        auto& dgram = readBatch[i];
+                        if(dgram.segmentSize == 0 || dgram.data.size() <= dgram.segmentSize) {
+                              client->received(dgram.peer, dgram.data);
+                        } else {
+                              for(std::size_t pos = 0; pos < dgram.data.size(); pos += dgram.segmentSize) {
+                                    auto const len = std::min<std::size_t>(dgram.segmentSize, dgram.data.size() - pos);
+                                    segment.assign(dgram.data.begin() + pos, dgram.data.begin() + pos + len);
+                                    client->received(dgram.peer, segment);
+                              }
+                        }
+                        dgram.data.resize(bufferSize);
+                  }
+                  if(static_cast<std::size_t>(numReceived) < readBatch.size()) {
+                        break;
+                  }
             }
-            client->received(from, data);
       }
 
       void UdpSocket::queueWrite(const InetDest& dest, const Bytes& data) {
-            logDebug("UdpSocket::queueWrite() " + dest.toString() + " " + std::to_string(fd));
-            logDebug("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX");
             std::lock_guard<std::mutex> sync(writeLock);
-            writeQueue.push_back(std::make_pair<const InetDest, const Bytes>(InetDest(dest), Bytes(data)));
-            handleWrite();
+            writeQueue.push_back(Datagram{dest, {}, data, 0});
+            if(!blocked && !writeTriggered) {
+                  writeTriggered = true;
+                  Engine::triggerWrites(this);
+            }
+      }
+
+      void UdpSocket::queueWrite(InetDest const& dest, Bytes const& data, uint16_t const segmentSize) {
+            if(segmentSize == 0) {
+                  queueWrite(dest, data);
+                  return;
+            }
+            std::lock_guard<std::mutex> sync(writeLock);
+            auto const segment = static_cast<uint16_t>(std::min<std::size_t>(segmentSize, MAX_GSO_SIZE));
+            std::size_t const perSend = gso ? std::min(MAX_GSO_SEGMENTS, MAX_GSO_SIZE / segment) * segment : segment;
+            assert(perSend > 0, "UdpSocket::queueWrite empty GSO send");
+            for(std::size_t pos = 0; pos < data.size(); pos += perSend) {
+                  auto const len = std::min(perSend, data.size() - pos);
+                  writeQueue.push_back(Datagram{dest, {}, Bytes(data.begin() + pos, data.begin() + pos + len), gso ? segment : uint16_t{0}});
+            }
+            if(!blocked && !writeTriggered) {
+                  writeTriggered = true;
+                  Engine::triggerWrites(this);
+            }
+      }
+
+      bool UdpSocket::enableGso() {
+            std::lock_guard<std::mutex> sync(writeLock);
+            gso = supportsGso();
+            return gso;
+      }
+
+      bool UdpSocket::enableGro() {
+            if(setGro(true)) {
+                  readBufferSize = MAX_GRO_SIZE;
+                  return true;
+            }
+            return false;
       }
 
       void UdpSocket::disconnect() {
@@ -63,46 +153,79 @@ namespace Sb {
             Engine::remove(self);
       }
 
-      void UdpSocket::doWrite(InetDest const& dest, Bytes const& data) {
-            logDebug(std::string("UdpSocket::doWrite writing " + dest.toString() + " " + std::to_string(data.size())) + " " + std::to_string(fd));
-            const auto actuallySent = sendDatagram(dest, data);
-            logDebug(std::string("UdpSocket::doWrite actually wrote " + std::to_string(actuallySent)));
-            pErrorLog(actuallySent, fd);
-            if (actuallySent == -1) {
-                  if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                        logDebug(std::string("UdpSocket::doWrite would block"));
-                        writeQueue.push_back(std::make_pair<const InetDest, const Bytes>(InetDest(dest), Bytes(data)));
-                        return;
-                  } else {
-                        logDebug(std::string("UdpSocket::doWrite failed completely"));
-                        client->notSent(dest, data);
+      void UdpSocket::handleWrite() {
+            std::deque<Datagram> failed;
+            bool drained = false;
+            {
+                  std::lock_guard<std::mutex> sync(writeLock);
+                  writeTriggered = false;
+                  blocked = false;
+                  while(writeQueue.size() > 0) {
+                        NanoSecs wait{0};
+                        auto const admitted = admitBatch(wait);
+                        if(admitted == 0) {
+                              writeTriggered = true;
+                              Engine::setTimer(egress, wait);
+                              break;
+                        }
+                        auto const numSent = sendDatagrams(writeQueue, admitted);
+                        if(rateLimiter) {
+                              for(auto i = static_cast<std::size_t>(std::max(numSent, 0)); i < admitted; ++i) {
+                                    rateLimiter->release(writeQueue[i].data.size());
+                              }
+                        }
+                        if(numSent >= 0) {
+                              writeQueue.erase(writeQueue.begin(), writeQueue.begin() + numSent);
+                        } else if(numSent == -1) {
+                              blocked = true;
+                              break;
+                        } else {
+                              failed.push_back(std::move(writeQueue.front()));
+                              writeQueue.pop_front();
+                        }
                   }
+                  drained = writeQueue.size() == 0;
+            }
+            for(auto const& dgram : failed) {
+                  client->notSent(dgram.peer, dgram.data);
             }
-            decltype(actuallySent) dataLen = data.size();
-            if (actuallySent == dataLen) {
-                  logDebug("Write " + std::to_string(actuallySent) + " out of " + std::to_string(dataLen) + " on " + std::to_string(fd));
-            } else if (actuallySent > 0) {
-                  logDebug("Partial write of " + std::to_string(actuallySent) + " out of " + std::to_string(dataLen));
-                  writeQueue.push_back(std::make_pair<const InetDest, const Bytes>(InetDest(dest), Bytes(data.begin() + actuallySent, data.end())));
+            if(drained) {
+                  client->writeComplete();
             }
       }
 
-      void UdpSocket::handleWrite() {
-            logDebug("UdpSocket::handleWrite() " + std::to_string(writeQueue.size()) + " " + std::to_string(fd));
-            for (; ;) {
-                  if (writeQueue.size() == 0) {
-                        logDebug("write queue is empty notifying client");
-                        client->writeComplete();
-                        return;
+      std::size_t UdpSocket::admitBatch(NanoSecs& wait) {
+            auto const batch = std::min(writeQueue.size(), MAX_DATAGRAM_BATCH);
+            if(!rateLimiter) {
+                  return batch;
+            }
+            std::size_t admitted = 0;
+            for(; admitted < batch; ++admitted) {
+                  wait = rateLimiter->acquire(writeQueue[admitted].data.size());
+                  if(wait.count() > 0) {
+                        break;
                   }
-                  const auto data = writeQueue.front();
-                  writeQueue.pop_front();
-                  doWrite(data.first, data.second);
             }
+            return admitted;
+      }
+
+      void UdpSocket::asyncEgress() {
+            std::lock_guard<std::mutex> sync(writeLock);
+            Engine::triggerWrites(this);
+      }
+
+      void UdpSocket::setRateLimiter(std::shared_ptr<RateLimiter> const& limiter) {
+            std::lock_guard<std::mutex> sync(writeLock);
+            rateLimiter = limiter;
       }
 
       bool UdpSocket::waitingOutEvent() {
-            return false;
+            std::lock_guard<std::mutex> sync(writeLock);
+            return blocked;
+      }
+
+      HandlerKind UdpSocket::handlerKind() const {
+            return HandlerKind::UdpSocket;
       }
 
       void UdpSocket::handleError() {
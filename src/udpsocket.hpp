@@ -2,6 +2,8 @@
 #include <atomic>
 #include <deque>
 #include <memory>
+#include "event.hpp"
+#include "ratelimiter.hpp"
 #include "socket.hpp"
 
 namespace Sb {
@@ -24,24 +26,45 @@ namespace Sb {
       class UdpSocket final : virtual public Socket {
       public:
             static void create(uint16_t const localPort, std::shared_ptr<UdpSocketIf> const& client);
-            static void create(InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client);
-            UdpSocket(std::shared_ptr<UdpSocketIf> const& client);
+            static void create(InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client, Priority const priority = Priority::Normal);
+            static void create(std::string const& path, std::shared_ptr<UdpSocketIf> const& client);
+            UdpSocket(std::shared_ptr<UdpSocketIf> const& client, SockType const type, int const inheritedFd = -1);
             void queueWrite(InetDest const& dest, Bytes const& data);
+            // Splits data into segmentSize datagrams, clamped to MAX_GSO_SIZE; zero sends it as a single datagram.
+            void queueWrite(InetDest const& dest, Bytes const& data, uint16_t const segmentSize);
+            bool enableGso();
+            bool enableGro();
+            void setRateLimiter(std::shared_ptr<RateLimiter> const& limiter);
             void disconnect();
             virtual ~UdpSocket();
             virtual void handleRead() override;
             virtual void handleWrite() override;
             virtual void handleError() override;
             virtual bool waitingOutEvent() override;
-            void doWrite(const InetDest& dest, const Bytes& data);
+            virtual HandlerKind handlerKind() const override;
 
       private:
             void bindAndAdd(std::shared_ptr<UdpSocket> const& me, uint16_t const localPort, std::shared_ptr<UdpSocketIf> const& client);
-            void connectAndAdd(std::shared_ptr<UdpSocket> const& me, InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client);
+            void bindAndAdd(std::shared_ptr<UdpSocket> const& me, std::string const& path, std::shared_ptr<UdpSocketIf> const& client);
+            void connectAndAdd(std::shared_ptr<UdpSocket> const& me, InetDest const& dest, std::shared_ptr<UdpSocketIf> const& client, Priority const priority);
+            std::size_t admitBatch(NanoSecs& wait);
+            void asyncEgress();
       private:
             std::shared_ptr<UdpSocketIf> client;
+            bool const inherited;
             std::mutex writeLock;
             std::mutex readLock;
-            std::deque<std::pair<InetDest const, Bytes const      >> writeQueue;
+            std::deque<Datagram> writeQueue;
+            std::shared_ptr<RateLimiter> rateLimiter;
+            Event egress;
+            std::vector<Datagram> readBatch;
+            std::atomic<std::size_t> readBufferSize{MAX_PACKET_SIZE};
+            Bytes segment;
+            bool gso = false;
+            bool blocked = false;
+            bool writeTriggered = false;
+            static constexpr std::size_t MAX_GSO_SEGMENTS = 64;
+            static constexpr std::size_t MAX_GSO_SIZE = 65000;
+            static constexpr std::size_t MAX_GRO_SIZE = 65535;
       };
 }
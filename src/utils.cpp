@@ -2,6 +2,7 @@
 #include <sys/epoll.h>
 #include "utils.hpp"
 #include <errno.h>
+#include <atomic>
 
 namespace Sb {
       void assert(bool ok, const std::string error) {
@@ -104,4 +105,10 @@ namespace Sb {
             stream << std::endl;
             return stream.str();
       }
+
+      std::size_t threadShard() {
+            static std::atomic<std::size_t> nextShard{0};
+            thread_local std::size_t const shard = nextShard.fetch_add(1, std::memory_order_relaxed) % THREAD_SHARDS;
+            return shard;
+      }
 }
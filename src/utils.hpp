@@ -8,12 +8,18 @@
 #include "types.hpp"
 
 namespace Sb {
+      constexpr std::size_t CACHE_LINE_SIZE = 64;
+      // Per-thread counters and histograms spread their updates over this many shards.
+      constexpr std::size_t THREAD_SHARDS = 16;
+
       InetDest destFromString(std::string const& dest, uint16_t const port);
       void assert(bool const ok, std::string const error);
       void pErrorThrow(int const error, int const fd = -1);
       void pErrorLog(int const error, int const fd);
       std::string pollEventsToString(uint32_t const events);
       std::string toHexString(Bytes const&src);
+      // The calling thread's shard, assigned round robin on first use.
+      std::size_t threadShard();
 
       template<typename T>
       std::string intToHexString(T const&number) {